@@ -0,0 +1,431 @@
+#include "./custom-alloc/custom_alloc.c"
+#include "./driver_common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+// Benchmark suite for the fit strategies and glibc malloc.
+//
+// Every (allocator, workload) pair runs twice, each time in a fresh child process so that no run
+// inherits the heap of another one: once untimed to measure throughput, once timing every operation
+// with clock_gettime to get the latency percentiles and sample the resident set size.
+// The results are written to stdout as CSV, one line per pair, with the system calls that grew and
+// shrank the heap of the fit strategies. The thread cache is turned off, so that the requests up to
+// TCACHE_MAX_SIZE reach the fit strategies too. The heap growth and trim parameters are read from the
+// environment, see custom_mallopt_from_env(), and listed on stderr with their effect.
+//
+// Build: gcc -O2 -o benchmark_custom_malloc benchmark_custom_malloc.c -lpthread -lm
+// Usage: [CUSTOM_ALLOC_GROWTH_STEP=n] [CUSTOM_ALLOC_TRIM_THRESHOLD=n] [CUSTOM_ALLOC_TOP_PAD=n]
+//        [CUSTOM_ALLOC_MMAP_THRESHOLD=n] benchmark_custom_malloc [operations] [live objects]
+
+#define DEFAULT_OPERATIONS 100000
+#define DEFAULT_LIVE_OBJECTS 4096
+#define CONSTANT_SIZE 512       // size of the constant workload, large enough to bypass the slabs
+#define POWER_LAW_MIN_SIZE 16   // smallest size of the power law workload
+#define POWER_LAW_MAX_SIZE 65536 // largest size of the power law workload, below the mmap threshold
+#define POWER_LAW_ALPHA 1.2     // tail index, most requests are small but a few are very large
+#define PRODUCER_MAX_SIZE 2048  // largest message of the producer/consumer workload
+#define LONG_LIVED_PERCENT 5    // messages the consumer keeps until the end of the run
+#define REALLOC_MAX_SIZE 65536  // size at which a growing buffer is dropped and started over
+#define RSS_SAMPLE_INTERVAL 1024 // operations between two resident set size samples
+#define SEED 42
+
+struct allocator
+{
+    const char *name;
+    meta_data (*find_free_block)(meta_data *prev, size_t size); // NULL for glibc malloc
+};
+
+struct bench
+{
+    meta_data (*find_free_block)(meta_data *prev, size_t size);
+    int timed;             // whether every operation is timed and the resident set size sampled
+    uint64_t *latencies;   // one entry per timed operation, in nanoseconds
+    size_t operations;     // operations performed so far
+    size_t live_objects;   // slots of the workload
+    uint64_t random_state; // xorshift state, so that every allocator sees the same sequence
+    int statm;             // /proc/self/statm, read without going through stdio which allocates
+    size_t rss_samples;
+    size_t rss_total;      // sum of the samples, in kilobytes
+    size_t rss_peak;       // in kilobytes
+};
+
+// Results of a pair, written by the children into shared memory
+struct bench_result
+{
+    size_t operations;
+    double seconds;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+    size_t peak_rss;
+    size_t average_rss;
+    size_t sbrk_calls; // calls growing the heaps, 0 for glibc malloc
+    size_t brk_calls;  // calls shrinking the heaps, 0 for glibc malloc
+};
+
+// Returns a size following a truncated power law between POWER_LAW_MIN_SIZE and POWER_LAW_MAX_SIZE
+static size_t power_law_size(struct bench *b)
+{
+    double u = (double)((next_random(&b->random_state) >> 11) + 1) / (double)(1ULL << 53);
+    double size = POWER_LAW_MIN_SIZE * pow(u, -1.0 / POWER_LAW_ALPHA);
+    return size > POWER_LAW_MAX_SIZE ? POWER_LAW_MAX_SIZE : (size_t)size;
+}
+
+static void sample_rss(struct bench *b)
+{
+    char buffer[64];
+    ssize_t length = pread(b->statm, buffer, sizeof(buffer) - 1, 0);
+    if (length <= 0)
+    {
+        return;
+    }
+    buffer[length] = '\0';
+    unsigned long size = 0, pages = 0;
+    // the second field is the resident set size, in pages
+    sscanf(buffer, "%lu %lu", &size, &pages);
+    size_t rss = pages * (size_t)sysconf(_SC_PAGESIZE) / 1024;
+    b->rss_total += rss;
+    b->rss_samples++;
+    if (rss > b->rss_peak)
+    {
+        b->rss_peak = rss;
+    }
+}
+
+// Writes one byte per page, so that the allocated memory counts towards the resident set size
+static void touch(void *ptr, size_t size)
+{
+    for (size_t offset = 0; offset < size; offset += 4096)
+    {
+        ((volatile char *)ptr)[offset] = 1;
+    }
+}
+
+static inline void record(struct bench *b, uint64_t start)
+{
+    if (b->timed)
+    {
+        b->latencies[b->operations] = now_ns() - start;
+        if (b->operations % RSS_SAMPLE_INTERVAL == 0)
+        {
+            sample_rss(b);
+        }
+    }
+    b->operations++;
+}
+
+static void *bench_malloc(struct bench *b, size_t size)
+{
+    uint64_t start = b->timed ? now_ns() : 0;
+    void *ptr = b->find_free_block ? custom_malloc(size, b->find_free_block) : malloc(size);
+    record(b, start);
+    if (ptr == NULL)
+    {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    touch(ptr, size);
+    return ptr;
+}
+
+static void *bench_realloc(struct bench *b, void *ptr, size_t size)
+{
+    uint64_t start = b->timed ? now_ns() : 0;
+    ptr = b->find_free_block ? custom_realloc(ptr, size, b->find_free_block) : realloc(ptr, size);
+    record(b, start);
+    if (ptr == NULL)
+    {
+        perror("realloc failed");
+        exit(EXIT_FAILURE);
+    }
+    touch(ptr, size);
+    return ptr;
+}
+
+static void bench_free(struct bench *b, void *ptr)
+{
+    uint64_t start = b->timed ? now_ns() : 0;
+    b->find_free_block ? custom_free(ptr) : free(ptr);
+    record(b, start);
+}
+
+// Frees every object left in the slots, these operations are measured like the others
+static void free_slots(struct bench *b, void **slots, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (slots[i])
+        {
+            bench_free(b, slots[i]);
+            slots[i] = NULL;
+        }
+    }
+}
+
+// Randomly allocates or frees objects of a single size
+static void constant_workload(struct bench *b, size_t operations)
+{
+    void **slots = driver_map(b->live_objects * sizeof(void *));
+    while (b->operations + b->live_objects < operations)
+    {
+        size_t slot = next_random(&b->random_state) % b->live_objects;
+        if (slots[slot])
+        {
+            bench_free(b, slots[slot]);
+            slots[slot] = NULL;
+        }
+        else
+        {
+            slots[slot] = bench_malloc(b, CONSTANT_SIZE);
+        }
+    }
+    free_slots(b, slots, b->live_objects);
+    munmap(slots, b->live_objects * sizeof(void *));
+}
+
+// Randomly allocates or frees objects whose sizes follow a power law
+static void power_law_workload(struct bench *b, size_t operations)
+{
+    void **slots = driver_map(b->live_objects * sizeof(void *));
+    while (b->operations + b->live_objects < operations)
+    {
+        size_t slot = next_random(&b->random_state) % b->live_objects;
+        if (slots[slot])
+        {
+            bench_free(b, slots[slot]);
+            slots[slot] = NULL;
+        }
+        else
+        {
+            slots[slot] = bench_malloc(b, power_law_size(b));
+        }
+    }
+    free_slots(b, slots, b->live_objects);
+    munmap(slots, b->live_objects * sizeof(void *));
+}
+
+// A producer allocates messages that a consumer frees in FIFO order once the queue is full, except
+// for a few long lived ones it keeps until the end, which pin the memory around them
+static void producer_consumer_workload(struct bench *b, size_t operations)
+{
+    size_t capacity = b->live_objects;
+    void **queue = driver_map(capacity * sizeof(void *));
+    void **kept = driver_map(operations * sizeof(void *));
+    size_t head = 0;
+    size_t kept_count = 0;
+    while (b->operations + capacity + kept_count < operations)
+    {
+        if (queue[head])
+        {
+            if (next_random(&b->random_state) % 100 < LONG_LIVED_PERCENT)
+            {
+                kept[kept_count++] = queue[head];
+            }
+            else
+            {
+                bench_free(b, queue[head]);
+            }
+        }
+        queue[head] = bench_malloc(b, next_random(&b->random_state) % PRODUCER_MAX_SIZE + 1);
+        head = (head + 1) % capacity;
+    }
+    free_slots(b, queue, capacity);
+    free_slots(b, kept, kept_count);
+    munmap(queue, capacity * sizeof(void *));
+    munmap(kept, operations * sizeof(void *));
+}
+
+// Grows random buffers by half of their size, like a vector or a string builder would, and drops
+// them once they reach REALLOC_MAX_SIZE
+static void realloc_growth_workload(struct bench *b, size_t operations)
+{
+    void **buffers = driver_map(b->live_objects * sizeof(void *));
+    size_t *sizes = driver_map(b->live_objects * sizeof(size_t));
+    while (b->operations + b->live_objects < operations)
+    {
+        size_t slot = next_random(&b->random_state) % b->live_objects;
+        if (buffers[slot] == NULL)
+        {
+            sizes[slot] = next_random(&b->random_state) % 64 + 16;
+            buffers[slot] = bench_malloc(b, sizes[slot]);
+        }
+        else if (sizes[slot] >= REALLOC_MAX_SIZE)
+        {
+            bench_free(b, buffers[slot]);
+            buffers[slot] = NULL;
+        }
+        else
+        {
+            sizes[slot] += sizes[slot] / 2;
+            buffers[slot] = bench_realloc(b, buffers[slot], sizes[slot]);
+        }
+    }
+    free_slots(b, buffers, b->live_objects);
+    munmap(buffers, b->live_objects * sizeof(void *));
+    munmap(sizes, b->live_objects * sizeof(size_t));
+}
+
+struct workload
+{
+    const char *name;
+    void (*run)(struct bench *b, size_t operations);
+};
+
+static int compare_latencies(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t count, double p)
+{
+    size_t index = (size_t)(p * (count - 1));
+    return sorted[index];
+}
+
+// Runs a workload in the calling process and stores its results
+static void run_pass(const struct allocator *allocator, const struct workload *workload, size_t operations,
+                     size_t live_objects, int timed, struct bench_result *result)
+{
+    struct bench b = {0};
+    b.find_free_block = allocator->find_free_block;
+    // the thread cache would serve every block up to TCACHE_MAX_SIZE the same way whatever the fit strategy
+    custom_set_thread_cache(0);
+    b.timed = timed;
+    b.live_objects = live_objects;
+    b.random_state = SEED;
+    if (timed)
+    {
+        // the producer/consumer workload may overshoot by one operation
+        b.latencies = driver_map((operations + 1) * sizeof(uint64_t));
+        b.statm = open("/proc/self/statm", O_RDONLY);
+        sample_rss(&b);
+    }
+
+    uint64_t start = now_ns();
+    workload->run(&b, operations);
+    uint64_t end = now_ns();
+
+    if (!timed)
+    {
+        result->operations = b.operations;
+        result->seconds = (end - start) / 1e9;
+        return;
+    }
+    sample_rss(&b);
+    close(b.statm);
+    qsort(b.latencies, b.operations, sizeof(uint64_t), compare_latencies);
+    result->p50 = percentile(b.latencies, b.operations, 0.50);
+    result->p99 = percentile(b.latencies, b.operations, 0.99);
+    result->p999 = percentile(b.latencies, b.operations, 0.999);
+    result->max = b.latencies[b.operations - 1];
+    result->peak_rss = b.rss_peak;
+    result->average_rss = b.rss_samples ? b.rss_total / b.rss_samples : 0;
+    if (allocator->find_free_block)
+    {
+        struct custom_alloc_stats stats;
+        custom_alloc_stats(&stats);
+        result->sbrk_calls = stats.sbrk_calls;
+        result->brk_calls = stats.brk_calls;
+    }
+}
+
+// Lists the heap growth and trim parameters in effect and what they trade
+static void print_parameters(void)
+{
+    fprintf(stderr, "# growth_step=%zu: first growth of a heap, doubling with every growth up to %d and halving with "
+                    "every trim; larger means fewer sbrk_calls and more memory taken ahead of need\n",
+            growth_step, MAX_GROWTH_STEP);
+    fprintf(stderr, "# trim_threshold=%zu: free tail beyond the top pad that makes a heap shrink; larger means fewer "
+                    "brk_calls and more idle memory\n",
+            trim_threshold);
+    fprintf(stderr, "# top_pad=%zu: free memory added to every growth and kept at every trim; absorbs a heap "
+                    "oscillating around one size at the cost of that much memory per arena\n",
+            top_pad);
+    fprintf(stderr, "# mmap_threshold=%zu: requests of at least this size are mapped on their own; lower means less "
+                    "heap fragmentation and a system call per allocation and free\n",
+            mmap_threshold);
+}
+
+// Runs a pass in a child process, so that it starts from an empty heap and a small resident set
+static void run_isolated(const struct allocator *allocator, const struct workload *workload, size_t operations,
+                         size_t live_objects, int timed, struct bench_result *result)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork failed");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        run_pass(allocator, workload, operations, live_objects, timed, result);
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "%s %s: benchmark process failed\n", allocator->name, workload->name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t operations = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_OPERATIONS;
+    size_t live_objects = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_LIVE_OBJECTS;
+    if (operations == 0 || live_objects == 0 || live_objects >= operations)
+    {
+        fprintf(stderr, "usage: %s [operations] [live objects], with live objects < operations\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    custom_mallopt_from_env();
+    print_parameters();
+
+    const struct allocator allocators[] = {
+        {"best_fit", &best_fit},
+        {"next_fit", &next_fit},
+        {"first_fit", &first_fit},
+        {"segregated_fit", &segregated_fit},
+        {"tree_best_fit", &tree_best_fit},
+        {"glibc", NULL},
+    };
+    const struct workload workloads[] = {
+        {"constant", &constant_workload},
+        {"power_law", &power_law_workload},
+        {"producer_consumer", &producer_consumer_workload},
+        {"realloc_growth", &realloc_growth_workload},
+    };
+
+    // the children report through memory shared with this process
+    struct bench_result *result = mmap(NULL, sizeof(*result), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (result == MAP_FAILED)
+    {
+        perror("mmap failed");
+        return EXIT_FAILURE;
+    }
+
+    printf("allocator,workload,operations,seconds,ops_per_second,p50_ns,p99_ns,p999_ns,max_ns,peak_rss_kb,average_rss_kb,"
+           "sbrk_calls,brk_calls\n");
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+    {
+        for (size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++)
+        {
+            memset(result, 0, sizeof(*result));
+            run_isolated(&allocators[a], &workloads[w], operations, live_objects, 0, result);
+            run_isolated(&allocators[a], &workloads[w], operations, live_objects, 1, result);
+            printf("%s,%s,%zu,%.6f,%.0f,%lu,%lu,%lu,%lu,%zu,%zu,%zu,%zu\n", allocators[a].name, workloads[w].name,
+                   result->operations, result->seconds, result->operations / result->seconds, (unsigned long)result->p50,
+                   (unsigned long)result->p99, (unsigned long)result->p999, (unsigned long)result->max, result->peak_rss,
+                   result->average_rss, result->sbrk_calls, result->brk_calls);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,503 +1,3683 @@
 #include "custom_alloc.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <execinfo.h>
 
-void check_correct_meta_data(meta_data block)
+char *secondary_arena_region = NULL; // reservation backing arenas 1 .. ARENA_COUNT - 1
+pthread_once_t secondary_arena_once = PTHREAD_ONCE_INIT;
+unsigned int next_arena_index = 0;
+ALLOC_TLS struct arena *thread_arena = NULL; // arena the calling thread allocates from
+
+// Returns the page size of the OS, which mprotect(), madvise() and munmap() work in
+static inline size_t os_page_size(void)
 {
-  if (heap_list_start == NULL || heap_list_end == NULL)
+  size_t size = __atomic_load_n(&system_page_size, __ATOMIC_RELAXED);
+  if (size == 0)
   {
-    return;
+    long queried = sysconf(_SC_PAGESIZE);
+    size = queried > 0 ? (size_t)queried : PAGE_SIZE;
+    __atomic_store_n(&system_page_size, size, __ATOMIC_RELAXED);
   }
+  return size;
+}
+
+// Returns the unit reservations are committed and trimmed in, whole huge pages while they are on
+static inline size_t commit_unit(void)
+{
+  return __atomic_load_n(&huge_pages, __ATOMIC_RELAXED) ? HUGE_PAGE_SIZE : os_page_size();
+}
 
-  meta_data end = sbrk(0);
-  if (block->next == NULL)
+// Maps "length" bytes at an address aligned to "alignment", by mapping more and unmapping the slack around it.
+// Returns MAP_FAILED on failure
+void *map_aligned(size_t length, size_t alignment, int prot, int flags)
+{
+  char *memory = mmap(NULL, length + alignment, prot, flags, -1, 0);
+  if (memory == MAP_FAILED)
   {
-    assert(block == heap_list_end );
+    return MAP_FAILED;
   }
-  else
+  char *aligned = (char *)ALLING((uintptr_t)memory, alignment);
+  if (aligned > memory)
   {
-    assert(block->next >= block);
-    assert(block->next < end);
-    assert(block->next > heap_list_start);
+    munmap(memory, aligned - memory);
   }
-  if (block->prev == NULL)
+  munmap(aligned + length, memory + alignment - aligned);
+  return aligned;
+}
+
+// Hands a reservation of ARENA_RESERVE_SIZE bytes at "base" to "arena"
+void reserve_arena(struct arena *arena, char *base)
+{
+  arena->base = base;
+  arena->top = base;
+  arena->committed = base;
+  arena->limit = base + ARENA_RESERVE_SIZE;
+}
+
+// Reserves the address space of all secondary arenas at once, so that the owner of a pointer is a division away.
+// The arenas start on huge page boundaries, so that their heaps can be backed by huge pages
+void reserve_secondary_arenas(void)
+{
+  size_t length = (ARENA_COUNT - 1) * ARENA_RESERVE_SIZE;
+  void *region = map_aligned(length, HUGE_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE);
+  if (region == MAP_FAILED)
   {
-    assert(block == heap_list_start);
+    return;
   }
-  else
+  for (int i = 1; i < ARENA_COUNT; i++)
   {
-    assert(block->prev <= block);
-    assert(block->prev < end);
-    assert(block->prev >= heap_list_start);
+    reserve_arena(&arenas[i], (char *)region + (i - 1) * ARENA_RESERVE_SIZE);
   }
-  assert(block->size > 0);
+  __atomic_store_n(&secondary_arena_region, (char *)region, __ATOMIC_RELEASE);
 }
 
-// Searches for the smallest free block that is large enough to satisfy the memory request
-// the idea is to minimize fragmentation by choosing the smallest possible available block
-meta_data best_fit(meta_data *prev, size_t size)
+/**
+ * @brief Returns the arena of the calling thread.
+ *
+ * Threads are assigned to arenas round-robin on their first allocation, so
+ * up to ARENA_COUNT threads never contend on the same lock. The first thread
+ * gets the main (sbrk) arena; if the secondary arenas cannot be reserved,
+ * every thread falls back to it.
+ */
+struct arena *get_thread_arena(void)
 {
-  // if no memory has been allocated yet
-  if (heap_list_start == NULL)
-  {
-    return NULL;
-  }
-
-  meta_data current = heap_list_start;
-  meta_data best_fit_ptr = NULL;
-  // ensures any valid block will be smaller
-  size_t min_size = -1;
-
-  while (current)
+  if (thread_arena == NULL)
   {
-    // check if the block is free, large enough and smaller than the current
-    if (current->free && current->size >= size && current->size < min_size)
+    unsigned int index = __atomic_fetch_add(&next_arena_index, 1, __ATOMIC_RELAXED) % ARENA_COUNT;
+    if (index != 0)
     {
-      *prev = current->prev;
-      best_fit_ptr = current;
-      min_size = current->size;
-      if (min_size == size)
+      pthread_once(&secondary_arena_once, reserve_secondary_arenas);
+      if (secondary_arena_region == NULL)
       {
-        break;
+        index = 0;
       }
     }
-    if (current->next == NULL)
-    {
-      heap_list_end  = current;
-    }
-    current = current->next;
+    thread_arena = &arenas[index];
   }
-
-  return best_fit_ptr;
+  return thread_arena;
 }
 
-// The Next Fit algorithm works similarly to First Fit, but instead of always searching from the beginning, it resumes searching from the last allocated block.
-meta_data next_fit(meta_data *prev, size_t size)
+// Returns the arena owning the address "p"; everything outside the secondary reservation belongs to the main arena
+struct arena *arena_for_address(void *p)
 {
-
-  // TODO: implement next fit algorithm
-
-  // if "last_allocated" is NULL, initialize it to the start of the memory pool
-  if (last_allocated == NULL)
+  char *region = __atomic_load_n(&secondary_arena_region, __ATOMIC_ACQUIRE);
+  if (region && (char *)p >= region && (char *)p < region + (ARENA_COUNT - 1) * ARENA_RESERVE_SIZE)
   {
-    last_allocated = heap_list_start;
+    return &arenas[1 + ((char *)p - region) / ARENA_RESERVE_SIZE];
   }
+  return &arenas[0];
+}
 
-  meta_data current = last_allocated;
-  if (heap_list_start != last_allocated)
+/**
+ * @brief sbrk() for an arena: grows the arena heap by "increment" bytes.
+ *
+ * The main arena moves the program break, secondary arenas make the next part
+ * of their reservation writable.
+ *
+ * @return The previous top of the arena, or (void *)-1 if it cannot grow.
+ */
+void *arena_sbrk(struct arena *arena, intptr_t increment)
+{
+  if (arena->base == NULL)
   {
-    while (current)
+    void *memory = sbrk(increment);
+    arena->stats.sbrk_calls++;
+    if (memory != (void *)-1)
     {
-      // if a free block of sufficient size is found
-      if (current->free && current->size >= size)
+      if (arena->brk_floor == NULL || (char *)memory < arena->brk_floor)
       {
-        *prev = current->prev;
-        // mark this block as the new starting point for the next allocation
-        last_allocated = current;
-        return current;
-      }
-      // if no suitable block is found, the function moves to the next step
-      if (current->next == NULL)
-      {
-        heap_list_end  = current;
+        arena->brk_floor = memory;
       }
-      current = current->next;
+      arena->top = (char *)memory + increment;
+      arena->stats.heap_bytes += increment;
     }
+    return memory;
   }
 
-  // if the first search did not find a suitable block, search from the beginning
-  current = last_allocated;
-  // stop if "current" reaches "last_allocated"
-  while (current)
+  char *memory = arena->top;
+  if (increment > arena->limit - memory)
+  {
+    return (void *)-1;
+  }
+  char *new_top = memory + increment;
+  if (new_top > arena->committed)
   {
-    if (current->free && current->size >= size)
+    arena->stats.sbrk_calls++;
+    char *new_committed = (char *)MIN(ALLING((uintptr_t)new_top, commit_unit()), (uintptr_t)arena->limit);
+    if (mprotect(arena->committed, new_committed - arena->committed, PROT_READ | PROT_WRITE) != 0)
     {
-      *prev = current->prev;
-      last_allocated = current;
-      return current;
+      return (void *)-1;
+    }
+    if (__atomic_load_n(&huge_pages, __ATOMIC_RELAXED))
+    {
+      madvise(arena->committed, new_committed - arena->committed, MADV_HUGEPAGE);
     }
-    current = current->prev;
+    arena->committed = new_committed;
   }
-
-  return NULL;
+  arena->top = new_top;
+  arena->stats.heap_bytes += increment;
+  return memory;
 }
 
-// we traverse the memory pool and allocate the first available block that is large enough to fit the requested size
-meta_data first_fit(meta_data *prev, size_t size)
+/**
+ * @brief brk() for an arena: shrinks the arena heap down to "addr".
+ *
+ * The main arena only moves the program break if nobody else moved it above
+ * the arena. Arenas on a reservation hand the whole pages above "addr" back to
+ * the OS and make them inaccessible again, whole huge pages while they are on.
+ */
+int arena_brk(struct arena *arena, void *addr)
 {
-  // implement first fit algorithm
-
-  meta_data current = heap_list_end ;
-  // Loop through the entire linked list until we reach the end (current == NULL)
-  while (current)
+  if (arena->base == NULL)
   {
-    if (current->free && current->size >= size)
+    // segments mapped while the break could not move are never trimmed
+    if ((char *)addr < arena->brk_floor || (char *)addr > arena->top || sbrk(0) != arena->top)
     {
-      *prev = current->prev;
-      return current;
+      return -1;
     }
-    if (current->next == NULL)
+    arena->stats.brk_calls++;
+    if (brk(addr) != 0)
     {
-      heap_list_end = current;
+      return -1;
     }
-    current = current->prev;
+    arena->stats.heap_bytes -= arena->top - (char *)addr;
+    arena->top = addr;
+    return 0;
   }
 
-  return NULL;
+  // nor are the segments the main arena mapped once its reservation was used up
+  if ((char *)addr < arena->base || (char *)addr > arena->top)
+  {
+    return -1;
+  }
+  char *new_committed = (char *)ALLING((uintptr_t)addr, commit_unit());
+  if (new_committed < arena->committed)
+  {
+    size_t length = arena->committed - new_committed;
+    arena->stats.brk_calls++;
+    madvise(new_committed, length, MADV_DONTNEED);
+    mprotect(new_committed, length, PROT_NONE);
+    arena->committed = new_committed;
+  }
+  arena->stats.heap_bytes -= arena->top - (char *)addr;
+  arena->top = addr;
+  return 0;
 }
 
-/**
- * @brief Adds a memory block to the memory pool.
- *
- * This function takes a memory block described by the meta_data structure
- * and adds it to the memory pool for future allocations.
- *
- * @param mem The memory block to be added to the pool.
- */
-void add_block_to_heap(meta_data mem)
+// Returns the word holding bit "index" of the two level bitmap "map", or NULL if there is none. The leaf of the word
+// is created if "create" is set; leaves are never freed, so they can be read without a lock
+uint64_t *radix_map_word(uint64_t **map, size_t root_size, unsigned leaf_bits, size_t leaf_size, uintptr_t index, int create)
 {
-  // if "mem_pool" is empty, set it as the First Block
-  if (heap_list_start == NULL)
+  uintptr_t root = index >> leaf_bits;
+  if (root >= root_size)
   {
-    heap_list_start = mem;
-    heap_list_start->next = NULL;
-    heap_list_start->prev = NULL;
-    heap_list_end = heap_list_start;
+    return NULL;
   }
-  else
+  uint64_t *leaf = __atomic_load_n(&map[root], __ATOMIC_ACQUIRE);
+  if (leaf == NULL)
   {
-    // add the new block to the end of the memory pool
-    heap_list_end ->next = mem;
-    mem->prev = heap_list_end ;
-    heap_list_end  = mem;
+    if (!create)
+    {
+      return NULL;
+    }
+    leaf = mmap(NULL, leaf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (leaf == MAP_FAILED)
+    {
+      return NULL;
+    }
+    // another arena may have created the leaf in the meantime
+    uint64_t *expected = NULL;
+    if (!__atomic_compare_exchange_n(&map[root], &expected, leaf, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      munmap(leaf, leaf_size);
+      leaf = expected;
+    }
   }
+  return &leaf[(index & (((uintptr_t)1 << leaf_bits) - 1)) / 64];
 }
 
-meta_data create_new_block(void *memory, meta_data next_block, meta_data prev_block, int status, size_t size)
+// Marks the block whose writable area is "ptr" as handed out or not in the block map. The lock guarding the block
+// must be held; a word of the map covers less than a page, so only that lock ever writes it
+void block_map_set(void *ptr, int allocated)
 {
-  meta_data block = memory;
-  block->size = size;
-  block->next = next_block;
-  block->prev = prev_block;
-  block->free = status;
-  // block->ptr = (void *)(block + 1);
-  //  Update the next block's prev pointer if it exists
-  if (block->next)
+  uintptr_t index = (uintptr_t)ptr >> BLOCK_ALIGN_SHIFT;
+  uint64_t *word = radix_map_word(block_map, BLOCK_MAP_ROOT_SIZE, BLOCK_MAP_LEAF_BITS, BLOCK_MAP_LEAF_SIZE, index, allocated);
+  if (word == NULL)
   {
-    block->next->prev = block;
+    return;
   }
-  if (block->prev)
+  uint64_t bit = (uint64_t)1 << (index & 63);
+  uint64_t bits = __atomic_load_n(word, __ATOMIC_RELAXED);
+  __atomic_store_n(word, allocated ? bits | bit : bits & ~bit, __ATOMIC_RELAXED);
+}
+
+// This function checks in O(1) if "ptr" is the writable area of a heap or mapped block handed out by the allocator,
+// without touching the memory around "ptr"
+int block_map_test(void *ptr)
+{
+  if ((uintptr_t)ptr & (BLOCK_ALIGN - 1))
   {
-    block->prev->next = block;
+    return 0;
   }
-  return block;
+  uintptr_t index = (uintptr_t)ptr >> BLOCK_ALIGN_SHIFT;
+  uint64_t *word = radix_map_word(block_map, BLOCK_MAP_ROOT_SIZE, BLOCK_MAP_LEAF_BITS, BLOCK_MAP_LEAF_SIZE, index, 0);
+  return word && ((__atomic_load_n(word, __ATOMIC_RELAXED) >> (index & 63)) & 1);
 }
 
-/**
- * @brief Splits a larger memory block into a smaller block of the requested size.
- *
- * This function takes a larger memory block and splits it into a smaller block
- * of the specified size. The remaining part of the larger block is kept as a
- * free block.
- *
- * @param block The larger memory block to be split.
- * @param size The size of the smaller block to be created.
- */
-void split_block(meta_data block, size_t size)
+void check_correct_meta_data(meta_data block)
 {
-
-  // compute the address of the new block
-  void *new_block_address = (void *)((char *)block + size + META_DATA_SIZE);
-  if ((long)(block->size - size - META_DATA_SIZE) < 0)
+#ifndef NDEBUG
+  if (heap_list_start == NULL || heap_list_fence == NULL)
   {
     return;
   }
-  // Initialize the new block
-  size_t new_block_size = block->size - size - META_DATA_SIZE;
-  if (new_block_size < META_DATA_SIZE)
+
+  char *end = current_arena->top;
+  assert(((uintptr_t)WRITABLE_AREA(block) & (BLOCK_ALIGN - 1)) == 0);
+  assert(BLOCK_SIZE(block) >= MIN_BLOCK_SIZE);
+  // segments the main arena mapped while the program break could not move may lie above the break
+  assert((char *)block >= end || (char *)NEXT_BLOCK(block) < end);
+  if (IS_FREE(block))
   {
-    return;
+    assert(FOOTER(block) == BLOCK_SIZE(block));
+    assert(NEXT_BLOCK(block)->size & PREV_FREE);
+    assert(!IS_FREE(NEXT_BLOCK(block)));
   }
-  meta_data new_block = create_new_block(new_block_address, block->next, block, 1, new_block_size);
-  // Update the original block
-  block->size = size;
-  if (new_block->next == NULL)
+  if (block->size & PREV_FREE)
   {
-    heap_list_end  = new_block;
+    assert(IS_FREE(PREV_BLOCK(block)));
+    assert(NEXT_BLOCK(PREV_BLOCK(block)) == block);
   }
-
-  check_correct_meta_data(block);
-  check_correct_meta_data(new_block);
+#else
+  (void)block;
+#endif
 }
 
-/**
- * @brief Merges consecutive free memory blocks into a single block
- *
- * This function iterates through the memory pool and merges adjacent free
- * memory blocks into a single larger block to reduce fragmentation.
- */
-void merge_blocks(meta_data ptr)
+// Returns the block following "block", crossing the fences between segments, or NULL after the last block
+meta_data next_block(meta_data block)
 {
-  check_correct_meta_data(ptr);
-
-  // If "ptr->next" exists and is free, merge it forward
-  if (ptr->next && ptr->next->free)
+  meta_data next = NEXT_BLOCK(block);
+  while (IS_FENCE(next))
   {
-    ptr->size += ptr->next->size + META_DATA_SIZE;
-    ptr->next = ptr->next->next;
-
-    if (ptr->next)
-    {
-      ptr->next->prev = ptr;
-    }
-    if (ptr->next == NULL)
+    next = FENCE_NEXT(next);
+    if (next == NULL)
     {
-      heap_list_end  = ptr;
+      return NULL;
     }
   }
-  check_correct_meta_data(ptr);
-  // If "ptr->prev" exists and is free, merge it backward
-  if (ptr->prev && ptr->prev->free)
-  {
-    ptr->prev->size += ptr->size + META_DATA_SIZE;
-    ptr->prev->next = ptr->next;
+  return next;
+}
 
-    if (ptr->next)
-    {
-      ptr->next->prev = ptr->prev;
-    }
-    if (ptr == NULL)
-    {
-      heap_list_end  = ptr->prev;
-    }
+// Sets or clears PREV_FREE in the header of "block". The block may be live and owned by another thread, which reads
+// its header without the arena lock in custom_free, hence the atomic store
+void set_prev_free(meta_data block, int prev_free)
+{
+  size_t size = prev_free ? block->size | PREV_FREE : block->size & ~(size_t)PREV_FREE;
+  __atomic_store_n(&block->size, size, __ATOMIC_RELAXED);
+}
+
+// Marks a block of "size" bytes as free: writes its footer and tells the following block about it
+void set_free(meta_data block, size_t size)
+{
+  block->size = size | BLOCK_FREE | (block->size & PREV_FREE);
+  FOOTER(block) = size;
+  set_prev_free(NEXT_BLOCK(block), 1);
+}
+
+// Marks a free block as allocated, its footer becomes part of the writable area
+void set_allocated(meta_data block)
+{
+  block->size &= ~(size_t)BLOCK_FREE;
+  set_prev_free(NEXT_BLOCK(block), 0);
+}
+
+// Maps a block size to its size-class bin.
+// Sizes up to SMALL_BIN_MAX get one bin per SIZE_CLASS_STEP, larger sizes share one bin per power of two
+int bin_index(size_t size)
+{
+  if (size <= SIZE_CLASS_STEP)
+  {
+    return 0;
   }
-  check_correct_meta_data(ptr);
+  if (size <= SMALL_BIN_MAX)
+  {
+    return (int)((size - 1) / SIZE_CLASS_STEP);
+  }
+  int index = SMALL_BIN_COUNT + (63 - __builtin_clzll(size - 1)) - SMALL_BIN_SHIFT;
+  return index < BIN_COUNT ? index : BIN_COUNT - 1;
 }
 
-/**
- * @brief Releases memory if certain conditions are met.
- *
- * This function checks specific conditions and releases memory accordingly.
- * The exact conditions and the memory release mechanism should be detailed
- * within the function implementation.
- */
-void release_memory_if_required()
+// Priority of a block in the treap, a hash of its address so that no priority has to be stored
+uint64_t tree_priority(meta_data block)
+{
+  uint64_t x = (uintptr_t)block;
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  return x;
+}
+
+// Order of the tree: by size, blocks of the same size by address
+int tree_less(meta_data a, meta_data b)
+{
+  size_t a_size = BLOCK_SIZE(a);
+  size_t b_size = BLOCK_SIZE(b);
+  return a_size < b_size || (a_size == b_size && a < b);
+}
+
+// Inserts a free block into the subtree "root" and returns the new root of the subtree
+meta_data tree_insert(meta_data root, meta_data block)
 {
+  if (root == NULL)
+  {
+    TREE_LINKS(block)->left = NULL;
+    TREE_LINKS(block)->right = NULL;
+    return block;
+  }
 
-  meta_data ptr = heap_list_end ;
-  meta_data free_area_start = NULL;
-  size_t totalFreeSpace = 0;
-  // computes the total free space available in the memory pool and keeps track of the starting address of the free area
-  while (ptr)
+  struct tree_links *links = TREE_LINKS(root);
+  if (tree_less(block, root))
   {
-    if (ptr->free)
+    links->left = tree_insert(links->left, block);
+    // rotate right if the new child outranks its parent
+    if (tree_priority(links->left) > tree_priority(root))
     {
-      free_area_start = ptr;
-      totalFreeSpace += ptr->size + META_DATA_SIZE;
+      meta_data child = links->left;
+      links->left = TREE_LINKS(child)->right;
+      TREE_LINKS(child)->right = root;
+      return child;
     }
-    else
+  }
+  else
+  {
+    links->right = tree_insert(links->right, block);
+    // rotate left if the new child outranks its parent
+    if (tree_priority(links->right) > tree_priority(root))
     {
-      free_area_start = NULL;
-      totalFreeSpace = 0;
-      break;
+      meta_data child = links->right;
+      links->right = TREE_LINKS(child)->left;
+      TREE_LINKS(child)->left = root;
+      return child;
     }
-    ptr = ptr->prev;
   }
-  // if the free area is less than the deallocation lot size or no free area exists, return
-  if (free_area_start == NULL || totalFreeSpace < (size_t)MEM_DEALLOC_SIZE)
+  return root;
+}
+
+// Joins two subtrees, where every block of "left" is ordered before every block of "right"
+meta_data tree_join(meta_data left, meta_data right)
+{
+  if (left == NULL)
+  {
+    return right;
+  }
+  if (right == NULL)
   {
-    return;
+    return left;
   }
+  if (tree_priority(left) > tree_priority(right))
+  {
+    TREE_LINKS(left)->right = tree_join(TREE_LINKS(left)->right, right);
+    return left;
+  }
+  TREE_LINKS(right)->left = tree_join(left, TREE_LINKS(right)->left);
+  return right;
+}
 
-  void *reset = NULL;
-
-  if (free_area_start ==heap_list_start)
+// Removes a free block from the subtree "root" and returns the new root of the subtree
+meta_data tree_remove(meta_data root, meta_data block)
+{
+  if (root == NULL)
   {
-    reset = heap_list_start;
-    heap_list_start = NULL;
-    last_allocated = NULL;
-    heap_list_end  = NULL;
+    return NULL;
+  }
+  struct tree_links *links = TREE_LINKS(root);
+  if (root == block)
+  {
+    return tree_join(links->left, links->right);
+  }
+  if (tree_less(block, root))
+  {
+    links->left = tree_remove(links->left, block);
   }
   else
   {
-
-    reset = free_area_start;
-
-    if (free_area_start->prev)
-    {
-      free_area_start->prev->next = NULL;
-      heap_list_end  = free_area_start->prev;
-    }
+    links->right = tree_remove(links->right, block);
   }
-
-  brk(reset);
+  return root;
 }
 
 /**
- * @brief Inserts a new memory block into the linked list of memory blocks.
+ * @brief Inserts a free block at the head of its size-class bin.
  *
- * This function inserts a new memory block of the specified size into the
- * linked list of memory blocks, immediately following the given previous
- * block. The new block's metadata is returned.
+ * Blocks beyond the small bins also enter the size-ordered tree.
  *
- * @param prev The metadata of the previous memory block in the linked list.
- * @param size The size of the new memory block to be inserted.
- * @return The metadata of the newly inserted memory block.
+ * @param block The free block to be inserted.
  */
-meta_data allocate_block(meta_data prev, size_t size)
+void bin_insert(meta_data block)
 {
-
-  void *memory = sbrk(size + META_DATA_SIZE); // Expands the heap space by "size + META_DATA_SIZE" bytes
-  // if sbrk() fails
-  if (memory == (void *)-1)
+  int index = bin_index(BLOCK_SIZE(block));
+  struct free_links *links = FREE_LINKS(block);
+  links->prev_free = NULL;
+  links->next_free = free_bins[index];
+  if (free_bins[index])
   {
-    return NULL;
+    FREE_LINKS(free_bins[index])->prev_free = block;
   }
+  free_bins[index] = block;
+  free_bins_bitmap |= 1ULL << index;
+  arena_stats.free_bytes += BLOCK_SIZE(block);
+  arena_stats.free_blocks++;
 
-  meta_data block = create_new_block(memory, NULL, prev, 0, size);
-  return block;
+  if (BLOCK_SIZE(block) > SMALL_BIN_MAX)
+  {
+    RECLAIMED(block) = 0;
+    free_tree_root = tree_insert(free_tree_root, block);
+  }
 }
 
 /**
- * @brief Allocates a block of memory of the specified size.
+ * @brief Unlinks a free block from its size-class bin.
  *
- * This function attempts to allocate a block of memory of the given size
- * using a custom memory allocation strategy. If the allocation is successful,
- * a pointer to the beginning of the block is returned. If the allocation fails,
- * a NULL pointer is returned.
+ * Must be called before the size of the block changes, otherwise the block
+ * is looked up in the wrong bin and at the wrong place of the tree.
  *
- * @param size The size of the memory block to allocate, in bytes.
- * @param find_free_block A function pointer to find a free memory block.
- * @return void* A pointer to the allocated memory block, or NULL if the allocation fails.
+ * @param block The free block to be removed.
  */
-void *custom_malloc(size_t size, meta_data (*find_free_block)(meta_data *prev, size_t size))
+void bin_remove(meta_data block)
 {
-  meta_data mem = NULL;
-  meta_data prev = NULL;
-  size_t s = ALLING(size, 32); // align the size to 4 bytes for better memory access efficiency
+  int index = bin_index(BLOCK_SIZE(block));
+  struct free_links *links = FREE_LINKS(block);
+  if (links->prev_free)
+  {
+    FREE_LINKS(links->prev_free)->next_free = links->next_free;
+  }
+  else
+  {
+    free_bins[index] = links->next_free;
+  }
+  if (links->next_free)
+  {
+    FREE_LINKS(links->next_free)->prev_free = links->prev_free;
+  }
+  if (free_bins[index] == NULL)
+  {
+    free_bins_bitmap &= ~(1ULL << index);
+  }
+  arena_stats.free_bytes -= BLOCK_SIZE(block);
+  arena_stats.free_blocks--;
 
-  // check memory-pool if any free memory available
-  mem = find_free_block(&prev, s);
+  if (BLOCK_SIZE(block) > SMALL_BIN_MAX)
+  {
+    // the pages given back are faulted in again as soon as the memory is written
+    current_arena->reclaimed -= RECLAIMED(block);
+    free_tree_root = tree_remove(free_tree_root, block);
+  }
+}
 
-  if (size == 0)
-    return mem;
+// Functions taking a strategy are inlined into their callers, so that a caller passing a strategy known at compile
+// time calls it directly. The strategies themselves are inlined wherever they are called directly, their address
+// still serves the function pointer API. See DEFINE_STRATEGY()
+#define STRATEGY_TEMPLATE static inline __attribute__((always_inline))
+#define STRATEGY inline __attribute__((always_inline))
 
-  if (mem == NULL) // if no free memory available in memory-pool
+// Searches for the smallest free block that is large enough to satisfy the memory request
+// the idea is to minimize fragmentation by choosing the smallest possible available block
+STRATEGY meta_data best_fit(meta_data *prev, size_t size)
+{
+  // if no memory has been allocated yet
+  if (heap_list_start == NULL)
   {
+    return NULL;
+  }
 
-    // allocate big chunk memory at once. Max of (Multiple of PAGE_SIZE,  MEM_ALLOC_LOT_SIZE)
-
-    size_t x = (s / PAGE_SIZE) + 1;
-    size_t prealloc_size = x * PAGE_SIZE; // makes sure that the size is multiple of PAGE_SIZE and not less than page size
-    size_t allocate_size = MAX(prealloc_size, MEM_ALLOC_SIZE);
+  meta_data current = heap_list_start;
+  meta_data previous = NULL;
+  meta_data best_fit_ptr = NULL;
+  // ensures any valid block will be smaller
+  size_t min_size = -1;
 
-    //"allocate_mem()" to request memory from the OS
-    if ((mem = allocate_block(prev, allocate_size)) == NULL)
+  arena_stats.searches[FIT_BEST]++;
+  while (current)
+  {
+    arena_stats.search_steps[FIT_BEST]++;
+    // check if the block is free, large enough and smaller than the current
+    size_t current_size = BLOCK_SIZE(current);
+    if (IS_FREE(current) && current_size >= size && current_size < min_size)
     {
-      return NULL;
+      *prev = previous;
+      best_fit_ptr = current;
+      min_size = current_size;
+      if (min_size == size)
+      {
+        break;
+      }
     }
-
-    add_block_to_heap(mem); // add the memory to memory-pool
+    previous = current;
+    current = next_block(current);
   }
 
-  // if the block is larger than the requested size, split it
-  split_block(mem, s);
-
-  // marks the block as allocated
-  mem->free = 0;
-  return WRITABLE_AREA(mem);
+  return best_fit_ptr;
 }
 
-// This function checks if a given pointer p is a valid memory address allocated by our custom memory allocator
-int is_valid_addr(void *p)
+// The Next Fit algorithm works similarly to First Fit, but instead of always searching from the beginning, it resumes searching from the last allocated block.
+STRATEGY meta_data next_fit(meta_data *prev, size_t size)
 {
-  if (heap_list_start)
+  // if "last_allocated" is NULL, initialize it to the start of the memory pool
+  if (last_allocated == NULL)
   {
-    // ensures our pointer is within "mem_pool", which is the start of our managed heap and "sbrk(0)", which is the current program break (end of allocated heap)
-    if (p > (void *)heap_list_start && p < sbrk(0))
-    {
-      // validate the adress
-      void *ptr = HEADER_AREA(p) + 1;
-      int res = ptr == p;
-      return res;
-    }
+    last_allocated = heap_list_start;
   }
-  return 0;
+
+  meta_data previous = NULL;
+  meta_data current = last_allocated;
+  arena_stats.searches[FIT_NEXT]++;
+  while (current)
+  {
+    arena_stats.search_steps[FIT_NEXT]++;
+    // if a free block of sufficient size is found
+    if (IS_FREE(current) && BLOCK_SIZE(current) >= size)
+    {
+      *prev = previous;
+      // mark this block as the new starting point for the next allocation
+      last_allocated = current;
+      return current;
+    }
+    // if no suitable block is found, the function moves to the next step
+    previous = current;
+    current = next_block(current);
+  }
+
+  // if the first search did not find a suitable block, search from the beginning
+  previous = NULL;
+  current = heap_list_start;
+  // stop if "current" reaches "last_allocated"
+  while (current && current != last_allocated)
+  {
+    arena_stats.search_steps[FIT_NEXT]++;
+    if (IS_FREE(current) && BLOCK_SIZE(current) >= size)
+    {
+      *prev = previous;
+      last_allocated = current;
+      return current;
+    }
+    previous = current;
+    current = next_block(current);
+  }
+
+  return NULL;
+}
+
+// we traverse the memory pool and allocate the first available block that is large enough to fit the requested size
+STRATEGY meta_data first_fit(meta_data *prev, size_t size)
+{
+  meta_data previous = NULL;
+  meta_data current = heap_list_start;
+  arena_stats.searches[FIT_FIRST]++;
+  // Loop through the entire heap until we reach the end (current == NULL)
+  while (current)
+  {
+    arena_stats.search_steps[FIT_FIRST]++;
+    if (IS_FREE(current) && BLOCK_SIZE(current) >= size)
+    {
+      *prev = previous;
+      return current;
+    }
+    previous = current;
+    current = next_block(current);
+  }
+
+  return NULL;
+}
+
+// Segregated fit only looks at free blocks: the bin of the requested size is scanned for a block that is
+// large enough and otherwise the first non-empty larger bin (found through the bitmap) is used, whose blocks all fit
+STRATEGY meta_data segregated_fit(meta_data *prev, size_t size)
+{
+  int index = bin_index(size);
+  // blocks carry no link to their predecessor anymore
+  *prev = NULL;
+
+  arena_stats.searches[FIT_SEGREGATED]++;
+  for (meta_data current = free_bins[index]; current; current = FREE_LINKS(current)->next_free)
+  {
+    arena_stats.search_steps[FIT_SEGREGATED]++;
+    if (BLOCK_SIZE(current) >= size)
+    {
+      return current;
+    }
+  }
+
+  if (index + 1 >= BIN_COUNT)
+  {
+    return NULL;
+  }
+  uint64_t larger_bins = free_bins_bitmap & (~0ULL << (index + 1));
+  if (larger_bins == 0)
+  {
+    return NULL;
+  }
+
+  arena_stats.search_steps[FIT_SEGREGATED]++;
+  return free_bins[__builtin_ctzll(larger_bins)];
+}
+
+// Best fit without the scan of the block list: the small bins hold one size each, so the first non-empty small bin
+// from the requested size on holds a best fit. Larger requests look up the smallest fitting block in the tree,
+// the lowest address among blocks of the same size as best_fit does
+STRATEGY meta_data tree_best_fit(meta_data *prev, size_t size)
+{
+  // blocks carry no link to their predecessor anymore
+  *prev = NULL;
+
+  arena_stats.searches[FIT_TREE]++;
+  if (size <= SMALL_BIN_MAX)
+  {
+    uint64_t small_bins = free_bins_bitmap & (~0ULL << bin_index(size)) & ((1ULL << SMALL_BIN_COUNT) - 1);
+    if (small_bins)
+    {
+      arena_stats.search_steps[FIT_TREE]++;
+      return free_bins[__builtin_ctzll(small_bins)];
+    }
+  }
+
+  meta_data best_fit_ptr = NULL;
+  meta_data current = free_tree_root;
+  while (current)
+  {
+    arena_stats.search_steps[FIT_TREE]++;
+    if (BLOCK_SIZE(current) >= size)
+    {
+      best_fit_ptr = current;
+      current = TREE_LINKS(current)->left;
+    }
+    else
+    {
+      current = TREE_LINKS(current)->right;
+    }
+  }
+  return best_fit_ptr;
 }
 
 /**
- * @brief Frees the memory space pointed to by ptr, which must have been returned by a previous call to custom_malloc, custom_calloc, or custom_realloc.
+ * @brief Adds a new segment of memory to the memory pool.
  *
- * This function does not return a value. The memory space is made available for future allocations.
+ * The segment is laid out as one allocated block followed by a fence, and is
+ * linked behind the last segment of the current arena.
  *
- * @param ptr Pointer to the memory block to be freed. If ptr is NULL, no operation is performed.
+ * @param memory The start of the memory obtained from the OS.
+ * @param length The length of the memory.
+ * @return The block spanning the segment, or NULL if the memory is too small.
  */
+meta_data add_block_to_heap(void *memory, size_t length)
+{
+  char *start = (char *)ALLING((uintptr_t)memory, BLOCK_ALIGN);
+  char *end = (char *)memory + length;
+  if (end - start < (long)(SEGMENT_OVERHEAD + MIN_BLOCK_SIZE))
+  {
+    return NULL;
+  }
 
-void custom_free(void *ptr)
+  // the writable areas are BLOCK_ALIGN aligned, so the first header sits one word into the segment
+  meta_data block = (meta_data)(start + META_DATA_SIZE);
+  block->size = (end - start - SEGMENT_OVERHEAD) & ~(size_t)BLOCK_FLAGS;
+  meta_data fence = NEXT_BLOCK(block);
+  fence->size = 0;
+  FENCE_NEXT(fence) = NULL;
+
+  // if "mem_pool" is empty, set it as the First Block
+  if (heap_list_fence == NULL)
+  {
+    heap_list_start = block;
+  }
+  else
+  {
+    // add the new segment to the end of the memory pool
+    FENCE_NEXT(heap_list_fence) = block;
+  }
+  heap_list_fence = fence;
+  return block;
+}
+
+// This function checks if "addr" is the current break of an arena, i.e. if the arena can grow right behind "addr"
+int arena_top_is(struct arena *arena, void *addr)
 {
-  if (ptr == NULL)
-    return;
-  // check if the pointer is valid
-  if (!is_valid_addr(ptr))
+  if (arena->base == NULL)
+  {
+    return sbrk(0) == addr;
+  }
+  return arena->top == (char *)addr;
+}
+
+/**
+ * @brief Splits a larger memory block into a smaller block of the requested size.
+ *
+ * This function takes a larger allocated memory block and splits it into a
+ * smaller block of the specified size. The remaining part of the larger block
+ * is kept as a free block.
+ *
+ * @param block The larger memory block to be split.
+ * @param size The size of the smaller block to be created, header included.
+ */
+void split_block(meta_data block, size_t size)
+{
+  size_t block_size = BLOCK_SIZE(block);
+  // the rest has to hold a block of its own
+  if (block_size < size + MIN_BLOCK_SIZE)
+  {
     return;
+  }
+  // Update the original block
+  block->size = size | (block->size & BLOCK_FLAGS);
 
-  meta_data block = HEADER_AREA(ptr); // retrieves the metadata block for "ptr"
-  block->free = 1;                    // marks the memory block as available
+  // Initialize the new block
+  meta_data new_block = NEXT_BLOCK(block);
+  size_t new_block_size = block_size - size;
+  new_block->size = 0;
+  // the rest of the block must not end up next to another free block
+  meta_data next = (meta_data)((char *)new_block + new_block_size);
+  if (IS_FREE(next))
+  {
+    bin_remove(next);
+    if (last_allocated == next)
+    {
+      last_allocated = new_block;
+    }
+    new_block_size += BLOCK_SIZE(next);
+  }
+  set_free(new_block, new_block_size);
+  bin_insert(new_block);
 
-  merge_blocks(block); // merge adjacent free blocks
+  check_correct_meta_data(block);
+  check_correct_meta_data(new_block);
+}
 
-  release_memory_if_required();
-  // memset(ptr, 0, block->size);
+/**
+ * @brief Frees a block and merges it with its free neighbours into a single block
+ *
+ * This function merges the free neighbours of a freshly freed block into a
+ * single larger block to reduce fragmentation and puts the result into its bin.
+ * The footer of a free predecessor tells where that predecessor starts.
+ *
+ * @return The merged free block.
+ */
+meta_data merge_blocks(meta_data ptr)
+{
+  size_t size = BLOCK_SIZE(ptr);
 
-  // Free the entire Heap if no memory is allocated
+  // If the next block is free, merge it forward
+  meta_data next = NEXT_BLOCK(ptr);
+  if (IS_FREE(next))
+  {
+    bin_remove(next);
+    if (last_allocated == next)
+    {
+      last_allocated = ptr;
+    }
+    size += BLOCK_SIZE(next);
+  }
+  // If the previous block is free, merge it backward
+  if (ptr->size & PREV_FREE)
+  {
+    meta_data prev = PREV_BLOCK(ptr);
+    bin_remove(prev);
+    if (last_allocated == ptr)
+    {
+      last_allocated = prev;
+    }
+    size += BLOCK_SIZE(prev);
+    ptr = prev;
+  }
+  set_free(ptr, size);
+  check_correct_meta_data(ptr);
+  bin_insert(ptr);
+  return ptr;
+}
+
+// Returns the bytes of the whole pages between the links and the footer of the free block "block"
+size_t reclaimable_bytes(meta_data block)
+{
+  // with huge pages on only whole huge pages are dropped, the others would be broken apart
+  size_t unit = commit_unit();
+  uintptr_t start = ALLING((uintptr_t)(&RECLAIMED(block) + 1), unit);
+  uintptr_t end = (uintptr_t)&FOOTER(block) & ~(uintptr_t)(unit - 1);
+  return end > start ? end - start : 0;
+}
+
+/**
+ * @brief Gives the whole pages inside a free block back to the OS.
+ *
+ * The pages between the links at the start of the block and its footer are
+ * dropped with madvise(MADV_DONTNEED), so the metadata of the block stays
+ * intact and the pages read as zero once they are used again. MADV_DONTNEED
+ * is used over MADV_FREE because it lowers the RSS right away.
+ *
+ * @param block A free block beyond the small bins, in the current arena.
+ * @return The number of bytes given back.
+ */
+size_t reclaim_block(meta_data block)
+{
+  size_t unit = commit_unit();
+  uintptr_t start = ALLING((uintptr_t)(&RECLAIMED(block) + 1), unit);
+  uintptr_t end = start + reclaimable_bytes(block);
+  // the block was dropped before and has not changed since
+  if (end <= start || RECLAIMED(block) == end - start)
+  {
+    return 0;
+  }
+  if (madvise((void *)start, end - start, MADV_DONTNEED) != 0)
+  {
+    return 0;
+  }
+  size_t dropped = end - start - RECLAIMED(block);
+  current_arena->reclaimed += dropped;
+  RECLAIMED(block) = end - start;
+  return dropped;
+}
+
+// Returns the bytes the free neighbours of "block" gave back to the OS, to be carried over once they are merged
+size_t reclaimed_neighbours(meta_data block)
+{
+  size_t reclaimed = 0;
+  if (block->size & PREV_FREE)
+  {
+    meta_data prev = PREV_BLOCK(block);
+    if (BLOCK_SIZE(prev) > SMALL_BIN_MAX)
+    {
+      reclaimed += RECLAIMED(prev);
+    }
+  }
+  meta_data next = NEXT_BLOCK(block);
+  if (IS_FREE(next) && BLOCK_SIZE(next) > SMALL_BIN_MAX)
+  {
+    reclaimed += RECLAIMED(next);
+  }
+  return reclaimed;
+}
+
+// Reclaims the pages of every free block in the subtree "root" and returns the number of bytes given back
+size_t reclaim_tree(meta_data root)
+{
+  if (root == NULL)
+  {
+    return 0;
+  }
+  return reclaim_block(root) + reclaim_tree(TREE_LINKS(root)->left) + reclaim_tree(TREE_LINKS(root)->right);
+}
+
+/**
+ * @brief Sets the size from which a freed block gives its interior pages back to the OS right away.
+ *
+ * Free blocks in the middle of the heap cannot be trimmed with brk, so their
+ * pages would stay resident until they are reused. 0 turns the reclaim on free
+ * off, custom_reclaim still works.
+ *
+ * @param threshold The new threshold in bytes.
+ */
+void custom_set_reclaim_threshold(size_t threshold)
+{
+  __atomic_store_n(&reclaim_threshold, threshold, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Gives the whole pages inside every free block of every arena back to the OS.
+ *
+ * Like malloc_trim, for services that go quiet after a spike. The heap is
+ * not shrunk, its free blocks just no longer hold resident pages.
+ *
+ * @return The number of bytes given back.
+ */
+size_t custom_reclaim(void)
+{
+  size_t reclaimed = 0;
+  for (int i = 0; i < ARENA_COUNT; i++)
+  {
+    pthread_mutex_lock(&arenas[i].lock);
+    current_arena = &arenas[i];
+    reclaimed += reclaim_tree(free_tree_root);
+    pthread_mutex_unlock(&arenas[i].lock);
+  }
+  return reclaimed;
+}
 
-  if (heap_list_start != NULL && heap_list_start->free && heap_list_start->next == NULL) // if first block is free
+/**
+ * @brief Releases memory if certain conditions are met.
+ *
+ * The free block at the end of the heap is given back to the OS once it
+ * exceeds the top pad by the trim threshold, down to the top pad; the end of
+ * what is left becomes the new fence. The gap between the two is a hysteresis,
+ * a heap that oscillates around one size keeps its tail instead of moving the
+ * break on every operation. Every trim halves the next growth of the heap, see
+ * heap_growth(). If the whole heap is a single free block and there is no top
+ * pad, the entire heap is released.
+ */
+void release_memory_if_required()
+{
+  meta_data fence = heap_list_fence;
+  if (fence == NULL || !(fence->size & PREV_FREE))
   {
+    return;
+  }
+  meta_data tail = PREV_BLOCK(fence);
+  size_t pad = __atomic_load_n(&top_pad, __ATOMIC_RELAXED);
+  size_t keep = pad ? ALLING(MAX(pad, MIN_BLOCK_SIZE), BLOCK_ALIGN) : 0;
+  if (BLOCK_SIZE(tail) <= keep || BLOCK_SIZE(tail) - keep < __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED))
+  {
+    return;
+  }
 
-    brk(heap_list_start); // release the entire heap back to the OS
+  // Free the entire Heap if no memory is allocated
+  if (tail == heap_list_start && keep == 0)
+  {
+    bin_remove(tail);
+    if (arena_brk(current_arena, (char *)tail - META_DATA_SIZE) != 0) // release the entire heap back to the OS
+    {
+      bin_insert(tail);
+      return;
+    }
     heap_list_start = NULL;
     last_allocated = NULL; // no memory is allocated
-    heap_list_end  = NULL;
+    heap_list_fence = NULL;
+    current_arena->growth = 0;
+    return;
+  }
+
+  bin_remove(tail);
+  meta_data new_fence = (meta_data)((char *)tail + keep);
+  if (arena_brk(current_arena, (char *)new_fence + FENCE_SIZE) != 0)
+  {
+    bin_insert(tail);
+    return;
+  }
+  new_fence->size = 0;
+  FENCE_NEXT(new_fence) = NULL;
+  heap_list_fence = new_fence;
+  current_arena->growth /= 2;
+  if (keep == 0)
+  {
+    if (last_allocated == tail)
+    {
+      last_allocated = NULL;
+    }
+    return;
   }
+  // the padding stays a free block, the fence behind it learns that from set_free()
+  set_free(tail, keep);
+  bin_insert(tail);
 }
 
-// This function resizes a previously allocated memory block. If necessary, it moves the block to a new location
-void *custom_realloc(void *ptr, size_t size, meta_data find_free_block(meta_data *prev, size_t size))
+// Adds a segment mapped with mmap to the main arena when its heap cannot grow: another mapping sits right above the
+// program break, or its reservation is used up. Returns its block, of at least "size" bytes, or NULL. The segment stays
+// part of the heap for good. The other arenas never map segments, see main_arena_memalign()
+meta_data map_heap_segment(size_t size)
 {
-  // If "ptr" is NULL, realloc() behaves like malloc(size)
-  if (!ptr)
+  if (current_arena != &arenas[0] || size > SIZE_MAX / 2)
   {
-    return custom_malloc(size, find_free_block);
+    return NULL;
   }
-  if (!is_valid_addr(ptr))
+  size_t length = ALLING(MAX(size + SEGMENT_OVERHEAD + BLOCK_ALIGN, HEAP_SEGMENT_SIZE), os_page_size());
+  void *memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED)
   {
     return NULL;
   }
-  // If the existing block is large enough, return the same block
-  meta_data block = HEADER_AREA(ptr);
-  if (block->size >= size)
+  arena_stats.heap_bytes += length;
+  current_arena->fresh = memory;
+  return add_block_to_heap(memory, length);
+}
+
+// Returns where the zero filled part of "memory", just taken from the OS by arena_sbrk(), starts. A lowered
+// break keeps the page it ends in and the other arenas keep their committed pages, only the pages past them are new
+static inline char *fresh_memory(char *committed, void *memory)
+{
+  return committed ? (char *)MAX(committed, memory) : (char *)ALLING((uintptr_t)memory, os_page_size());
+}
+
+/**
+ * @brief Grows the heap of the current arena by a new block.
+ *
+ * If the arena break sits right behind the last fence, the fence becomes the
+ * header of the new block and moves to the new end of the heap. Otherwise the
+ * memory starts a new segment.
+ *
+ * @param size The size of the new memory block, header included.
+ * @return The metadata of the new, allocated memory block.
+ */
+meta_data allocate_block(size_t size)
+{
+  meta_data fence = heap_list_fence;
+  char *committed = current_arena->base ? current_arena->committed : NULL;
+  if (fence && arena_top_is(current_arena, (char *)fence + FENCE_SIZE))
   {
-    return ptr;
+    void *memory = arena_sbrk(current_arena, size); // Expands the heap space by "size" bytes
+    // if sbrk() fails
+    if (memory == (void *)-1)
+    {
+      return map_heap_segment(size);
+    }
+    current_arena->fresh = fresh_memory(committed, memory);
+    if (memory == (char *)fence + FENCE_SIZE)
+    {
+      meta_data block = fence;
+      block->size = size | (fence->size & PREV_FREE);
+      meta_data new_fence = NEXT_BLOCK(block);
+      new_fence->size = 0;
+      FENCE_NEXT(new_fence) = NULL;
+      heap_list_fence = new_fence;
+      return block;
+    }
+    // someone else moved the break in between
+    return add_block_to_heap(memory, size);
   }
-  void *new_ptr;
-  // If the block is too small, allocate a new one with the requested size
-  new_ptr = custom_malloc(size, find_free_block);
-  if (!new_ptr)
+
+  // a new segment has to start on a BLOCK_ALIGN boundary
+  char *top = current_arena->base == NULL ? sbrk(0) : current_arena->top;
+  size_t length = (-(uintptr_t)top & (BLOCK_ALIGN - 1)) + SEGMENT_OVERHEAD + size;
+  void *memory = arena_sbrk(current_arena, length);
+  if (memory == (void *)-1)
   {
-    return NULL;
+    return map_heap_segment(size);
   }
-  memcpy(new_ptr, ptr, block->size); // Copy the data from the old block to the new block
-  custom_free(ptr);                  // Free the old block
-  return new_ptr;
+  current_arena->fresh = fresh_memory(committed, memory);
+  return add_block_to_heap(memory, length);
 }
 
-// This function allocates memory for an array and initializes it to zero
-//@param "nelem" number of elements and "elsize" size of each element
-void *custom_calloc(size_t nelem, size_t elsize, meta_data find_free_block(meta_data *prev, size_t size))
+// Returns how many bytes to grow the heap of the current arena by for a block of "size" bytes. Every growth doubles
+// the next one up to MAX_GROWTH_STEP, so that a growing heap needs few system calls, and every trim halves it again.
+// The top pad comes on top, so that the free tail the growth leaves behind serves the next requests
+size_t heap_growth(size_t size)
 {
+  size_t step = MAX(current_arena->growth, __atomic_load_n(&growth_step, __ATOMIC_RELAXED));
+  current_arena->growth = MIN(step * 2, MAX(step, (size_t)MAX_GROWTH_STEP));
+  return ALLING(MAX(size + 1, step) + __atomic_load_n(&top_pad, __ATOMIC_RELAXED), PAGE_SIZE);
+}
 
-  size_t size = nelem * elsize;                     // calculate the total size of the array
-  void *ptr = custom_malloc(size, find_free_block); // allocate the required memory
-  memset(ptr, 0, size);                             // initialize the memory to zero
+/**
+ * @brief Maps a block of its own for a large request whose writable area is aligned to "alignment".
+ *
+ * The mapping leaves room to move the block up to the next aligned address,
+ * the pages in front of the bookkeeping and behind the block are unmapped again.
+ *
+ * @param alignment The alignment of the writable area, a power of two of at least BLOCK_ALIGN.
+ * @param size The size of the memory block to allocate, in bytes.
+ * @return void* A pointer to the writable area of the block, or NULL if mmap fails.
+ */
+void *mmap_block_aligned(size_t alignment, size_t size)
+{
+  if (size > SIZE_MAX / 2 || alignment > SIZE_MAX / 4)
+  {
+    return NULL;
+  }
+  size_t page = os_page_size();
+  size_t length = ALLING(size + MMAP_HEADER_OFFSET + alignment, page);
+  char *memory;
+  // blocks of huge pages start on a huge page boundary, the kernel backs only aligned huge pages
+  int huge = __atomic_load_n(&huge_pages, __ATOMIC_RELAXED) && length >= HUGE_PAGE_SIZE;
+  if (huge)
+  {
+    memory = map_aligned(length, HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS);
+  }
+  else
+  {
+    memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (memory == MAP_FAILED)
+  {
+    return NULL;
+  }
 
-  return ptr;
+  meta_data block = HEADER_AREA(ALLING((uintptr_t)memory + MMAP_HEADER_OFFSET + META_DATA_SIZE, alignment));
+  struct mmap_chunk *chunk = MMAP_CHUNK(block);
+  // the mapping starts at the page of the bookkeeping, munmap_block finds it from there
+  char *start = (char *)((uintptr_t)chunk & ~(uintptr_t)(page - 1));
+  char *end = (char *)ALLING((uintptr_t)WRITABLE_AREA(block) + size + META_DATA_SIZE, page);
+  if (start > memory)
+  {
+    munmap(memory, start - memory);
+  }
+  if (end < memory + length)
+  {
+    munmap(end, memory + length - end);
+  }
+  length = end - start;
+  if (huge)
+  {
+    madvise(start, length, MADV_HUGEPAGE);
+  }
+
+  block->size = ((end - (char *)block) & ~(size_t)BLOCK_FLAGS) | BLOCK_MMAPPED;
+  chunk->length = length;
+
+  pthread_mutex_lock(&mmap_lock);
+  mmap_bytes += length;
+  mmap_blocks++;
+  chunk->prev = NULL;
+  chunk->next = mmap_list;
+  if (mmap_list)
+  {
+    mmap_list->prev = chunk;
+  }
+  mmap_list = chunk;
+  block_map_set(WRITABLE_AREA(block), 1);
+  pthread_mutex_unlock(&mmap_lock);
+  return WRITABLE_AREA(block);
+}
+
+/**
+ * @brief Maps a block of its own for a large request.
+ *
+ * The block never enters an arena, so it is not seen by the fit strategies and
+ * its pages go straight back to the OS when it is freed.
+ *
+ * @param size The size of the memory block to allocate, in bytes.
+ * @return void* A pointer to the writable area of the block, or NULL if mmap fails.
+ */
+void *mmap_block(size_t size)
+{
+  return mmap_block_aligned(BLOCK_ALIGN, size);
+}
+
+// This function checks if "p" is the writable area of a directly mapped block, "mmap_lock" must be held
+int is_mmapped_addr(void *p)
+{
+  return block_map_test(p) && (HEADER_AREA(p)->size & BLOCK_MMAPPED);
+}
+
+// Unlinks a directly mapped block and unmaps it
+void munmap_block(void *ptr)
+{
+  pthread_mutex_lock(&mmap_lock);
+  if (!__atomic_load_n(&trusted_free, __ATOMIC_RELAXED) && !is_mmapped_addr(ptr))
+  {
+    pthread_mutex_unlock(&mmap_lock);
+    return;
+  }
+  struct mmap_chunk *chunk = MMAP_CHUNK(HEADER_AREA(ptr));
+  block_map_set(ptr, 0);
+  if (chunk->prev)
+  {
+    chunk->prev->next = chunk->next;
+  }
+  else
+  {
+    mmap_list = chunk->next;
+  }
+  if (chunk->next)
+  {
+    chunk->next->prev = chunk->prev;
+  }
+  mmap_bytes -= chunk->length;
+  mmap_blocks--;
+  pthread_mutex_unlock(&mmap_lock);
+
+  // the bookkeeping of an aligned block may lie past the start of its first page
+  munmap((void *)((uintptr_t)chunk & ~(uintptr_t)(os_page_size() - 1)), chunk->length);
+}
+
+/**
+ * @brief Sets the size from which custom_malloc maps blocks directly with mmap.
+ *
+ * Blocks below the threshold come from the arenas. Already allocated blocks
+ * are not affected.
+ *
+ * @param threshold The new threshold in bytes.
+ */
+void custom_set_mmap_threshold(size_t threshold)
+{
+  __atomic_store_n(&mmap_threshold, threshold, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Sets the largest request custom_malloc serves from slabs.
+ *
+ * Values above SLAB_MAX_SIZE are clamped, 0 turns the slabs off. Objects
+ * already allocated from slabs are not affected.
+ *
+ * @param size The new limit in bytes.
+ */
+void custom_set_slab_max_size(size_t size)
+{
+  __atomic_store_n(&slab_max_size, size < SLAB_MAX_SIZE ? size : SLAB_MAX_SIZE, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Coalesces every block parked in the quick lists of the current arena, whose lock must be held.
+ *
+ * Each block is merged with its free neighbours as if it had just been
+ * freed, then the heap tail is given back to the OS once for the whole batch.
+ */
+void consolidate_quick_lists()
+{
+  if (quick_lists_count == 0)
+  {
+    return;
+  }
+  for (int i = 0; i < QUICK_COUNT; i++)
+  {
+    meta_data block = quick_lists[i];
+    quick_lists[i] = NULL;
+    while (block)
+    {
+      meta_data next = QUICK_NEXT(block);
+      block->size &= ~(size_t)BLOCK_QUICK;
+      merge_blocks(block);
+      block = next;
+    }
+  }
+  quick_lists_count = 0;
+  arena_stats.quick_bytes = 0;
+  release_memory_if_required();
+}
+
+/**
+ * @brief Turns deferred coalescing on or off for every arena.
+ *
+ * When it is on, custom_free parks blocks of up to QUICK_MAX_SIZE bytes in a
+ * quick list of their exact size instead of merging them, and the next request
+ * of that size takes them back without a search or a split. The parked blocks
+ * are coalesced in one pass once QUICK_THRESHOLD of them pile up in an arena or
+ * an allocation finds no free block. Turning it off coalesces all parked blocks.
+ *
+ * @param enabled Non-zero to defer coalescing.
+ */
+void custom_set_deferred_coalescing(int enabled)
+{
+  __atomic_store_n(&deferred_coalescing, enabled != 0, __ATOMIC_RELAXED);
+  if (enabled)
+  {
+    return;
+  }
+  for (int i = 0; i < ARENA_COUNT; i++)
+  {
+    pthread_mutex_lock(&arenas[i].lock);
+    current_arena = &arenas[i];
+    consolidate_quick_lists();
+    pthread_mutex_unlock(&arenas[i].lock);
+  }
+}
+
+/**
+ * @brief Turns the validation of freed pointers off or on.
+ *
+ * By default every free checks that its pointer is a block of the allocator
+ * and ignores it otherwise. In trusted mode the caller vouches for its
+ * pointers and these checks are skipped; freeing a pointer the allocator did
+ * not hand out then corrupts the heap. The default comes from the
+ * CUSTOM_ALLOC_TRUSTED build flag.
+ *
+ * @param enabled Non-zero to trust freed pointers.
+ */
+void custom_set_trusted_free(int enabled)
+{
+  __atomic_store_n(&trusted_free, enabled != 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Turns the thread caches on or off.
+ *
+ * With the caches on, a thread keeps the small objects it frees and
+ * allocates them again without taking a lock, and hands the objects of other
+ * arenas over in batches. With the caches off every allocation and free takes
+ * the lock of its arena. Objects cached already stay until their thread
+ * flushes its cache, see custom_thread_cache_flush().
+ *
+ * @param enabled Non-zero to use the thread caches.
+ */
+void custom_set_thread_cache(int enabled)
+{
+  __atomic_store_n(&thread_cache_enabled, enabled != 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Turns transparent huge pages for the heaps on or off.
+ *
+ * With huge pages on, the arenas commit their reservation in units of
+ * HUGE_PAGE_SIZE marked with madvise(MADV_HUGEPAGE), and give only whole
+ * units back when they shrink or reclaim free blocks, so that no huge page is
+ * broken apart. Mapped blocks of at least HUGE_PAGE_SIZE are aligned and
+ * marked the same way. The program break is not aligned, so the main arena
+ * moves to a reservation of its own, provided nothing is allocated from it yet.
+ *
+ * @param enabled Non-zero to use huge pages.
+ */
+void custom_set_huge_pages(int enabled)
+{
+  __atomic_store_n(&huge_pages, enabled != 0, __ATOMIC_RELAXED);
+  struct arena *arena = &arenas[0];
+  pthread_mutex_lock(&arena->lock);
+  if (enabled && arena->base == NULL && arena->list_start == NULL)
+  {
+    void *base = map_aligned(ARENA_RESERVE_SIZE, HUGE_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE);
+    if (base != MAP_FAILED)
+    {
+      reserve_arena(arena, base);
+    }
+  }
+  pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * @brief Tunes the allocator like mallopt().
+ *
+ * CUSTOM_M_GROWTH_STEP sets the first growth of a heap, rounded up to
+ * PAGE_SIZE. Every further growth doubles up to MAX_GROWTH_STEP, and every
+ * trim halves it again: larger steps mean fewer sbrk calls and more memory
+ * taken ahead of need. CUSTOM_M_TRIM_THRESHOLD sets how far the free tail of a
+ * heap has to exceed the top pad before it is given back: larger thresholds
+ * mean fewer brk calls and more idle memory. CUSTOM_M_TOP_PAD sets the free
+ * memory added to every growth and kept at every trim, a buffer against a heap
+ * that grows and shrinks around one size. CUSTOM_M_MMAP_THRESHOLD is
+ * custom_set_mmap_threshold().
+ *
+ * @param param One of enum custom_mallopt_param.
+ * @param value The new value in bytes.
+ * @return 1 on success, 0 for an unknown parameter or a negative value.
+ */
+int custom_mallopt(int param, int value)
+{
+  if (value < 0)
+  {
+    return 0;
+  }
+  switch (param)
+  {
+  case CUSTOM_M_GROWTH_STEP:
+    __atomic_store_n(&growth_step, MAX(ALLING((size_t)value, PAGE_SIZE), PAGE_SIZE), __ATOMIC_RELAXED);
+    return 1;
+  case CUSTOM_M_TRIM_THRESHOLD:
+    __atomic_store_n(&trim_threshold, (size_t)value, __ATOMIC_RELAXED);
+    return 1;
+  case CUSTOM_M_TOP_PAD:
+    __atomic_store_n(&top_pad, (size_t)value, __ATOMIC_RELAXED);
+    return 1;
+  case CUSTOM_M_MMAP_THRESHOLD:
+    custom_set_mmap_threshold((size_t)value);
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/**
+ * @brief Reads the custom_mallopt() parameters from the environment.
+ *
+ * CUSTOM_ALLOC_GROWTH_STEP, CUSTOM_ALLOC_TRIM_THRESHOLD, CUSTOM_ALLOC_TOP_PAD
+ * and CUSTOM_ALLOC_MMAP_THRESHOLD hold a size in bytes; the parameters not
+ * set keep their value. getenv and strtol do not allocate, so this is safe to
+ * call before the allocator is up.
+ */
+void custom_mallopt_from_env(void)
+{
+  static const struct
+  {
+    const char *name;
+    int param;
+  } variables[] = {
+      {"CUSTOM_ALLOC_GROWTH_STEP", CUSTOM_M_GROWTH_STEP},
+      {"CUSTOM_ALLOC_TRIM_THRESHOLD", CUSTOM_M_TRIM_THRESHOLD},
+      {"CUSTOM_ALLOC_TOP_PAD", CUSTOM_M_TOP_PAD},
+      {"CUSTOM_ALLOC_MMAP_THRESHOLD", CUSTOM_M_MMAP_THRESHOLD},
+  };
+  for (size_t i = 0; i < sizeof(variables) / sizeof(variables[0]); i++)
+  {
+    const char *value = getenv(variables[i].name);
+    if (value)
+    {
+      long parsed = strtol(value, NULL, 0);
+      custom_mallopt(variables[i].param, parsed > INT_MAX ? INT_MAX : (int)parsed);
+    }
+  }
+}
+
+void *slab_malloc(size_t size, meta_data (*find_free_block)(meta_data *prev, size_t size));
+void arena_free(void *ptr);
+void drain_remote_frees(struct arena *arena, struct thread_cache *cache);
+void *main_arena_memalign(size_t alignment, size_t size, meta_data (*find_free_block)(meta_data *prev, size_t size), char **fresh);
+
+// Returns non-zero if the calling thread may use its cache
+static inline int thread_cache_usable(struct thread_cache *cache)
+{
+  return cache->state >= 0 && __atomic_load_n(&thread_cache_enabled, __ATOMIC_RELAXED);
+}
+
+// Puts an object of usable size class "index" in front of its bin
+static inline void tcache_push(struct thread_cache *cache, size_t index, void *object)
+{
+  ((void **)object)[0] = cache->bins[index];
+  ((void **)object)[1] = cache; // marks the object as cached, see thread_cache_free()
+  cache->bins[index] = object;
+  cache->counts[index]++;
+}
+
+// Takes the first object of the non-empty bin "index"
+static inline void *tcache_pop(struct thread_cache *cache, size_t index)
+{
+  void *object = cache->bins[index];
+  cache->bins[index] = ((void **)object)[0];
+  ((void **)object)[1] = NULL;
+  cache->counts[index]--;
+  return object;
+}
+
+// Allocates "size" bytes from the current arena, whose lock must be held
+STRATEGY_TEMPLATE void *arena_malloc(size_t size, meta_data (*find_free_block)(meta_data *prev, size_t size))
+{
+  meta_data mem = NULL;
+  meta_data prev = NULL;
+
+  if (size == 0 || size > SIZE_MAX / 2)
+    return NULL;
+
+  arena_stats.class_allocations[bin_index(REQUEST_SIZE(size))]++;
+  // small objects are packed into slabs
+  if (size <= __atomic_load_n(&slab_max_size, __ATOMIC_RELAXED))
+    return slab_malloc(size, find_free_block);
+
+  size_t s = REQUEST_SIZE(size); // add the header and align the block for better memory access efficiency
+
+  // a block parked in the quick list of this size fits exactly
+  if (s <= QUICK_MAX_SIZE && quick_lists[s / BLOCK_ALIGN])
+  {
+    mem = quick_lists[s / BLOCK_ALIGN];
+    quick_lists[s / BLOCK_ALIGN] = QUICK_NEXT(mem);
+    quick_lists_count--;
+    mem->size &= ~(size_t)BLOCK_QUICK;
+    current_arena->live_blocks++;
+    arena_stats.quick_bytes -= s;
+    arena_stats.used_bytes += s;
+    block_map_set(WRITABLE_AREA(mem), 1);
+    return WRITABLE_AREA(mem);
+  }
+
+  // check memory-pool if any free memory available
+  mem = find_free_block(&prev, s);
+  if (mem == NULL && quick_lists_count > 0)
+  {
+    // the parked blocks may merge into a large enough block
+    consolidate_quick_lists();
+    mem = find_free_block(&prev, s);
+  }
+
+  if (mem != NULL)
+  {
+    bin_remove(mem);
+    // marks the block as allocated
+    set_allocated(mem);
+  }
+  else // if no free memory available in memory-pool
+  {
+
+    // allocate big chunk memory at once, a multiple of PAGE_SIZE larger than the request
+    size_t allocate_size = heap_growth(s);
+
+    //"allocate_block()" to request memory from the OS and add it to the memory-pool
+    if ((mem = allocate_block(allocate_size)) == NULL)
+    {
+      return NULL;
+    }
+    // a free tail in front of the new memory, e.g. the top pad, joins it instead of staying behind as a hole
+    mem = merge_blocks(mem);
+    if (BLOCK_SIZE(mem) < s)
+    {
+      return NULL;
+    }
+    bin_remove(mem);
+    set_allocated(mem);
+  }
+
+  // if the block is larger than the requested size, split it
+  split_block(mem, s);
+  current_arena->live_blocks++;
+  arena_stats.used_bytes += BLOCK_SIZE(mem);
+  block_map_set(WRITABLE_AREA(mem), 1);
+
+  return WRITABLE_AREA(mem);
+}
+
+/**
+ * @brief Allocates a block of memory of the specified size.
+ *
+ * This function attempts to allocate a block of memory of the given size
+ * using a custom memory allocation strategy. If the allocation is successful,
+ * a pointer to the beginning of the block is returned. If the allocation fails,
+ * a NULL pointer is returned. The block is taken from the arena of the calling thread,
+ * or from the main arena once that arena has used up its reservation.
+ *
+ * @param size The size of the memory block to allocate, in bytes.
+ * @param find_free_block A function pointer to find a free memory block.
+ * @return void* A pointer to the allocated memory block, or NULL if the allocation fails.
+ */
+STRATEGY_TEMPLATE void *untraced_malloc(size_t size, meta_data (*find_free_block)(meta_data *prev, size_t size))
+{
+  if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
+  {
+    return mmap_block(size);
+  }
+
+  struct arena *arena = get_thread_arena();
+  // a cached object of the size class rounded up is large enough, without a lock
+  size_t index = (size + SIZE_CLASS_STEP - 1) / SIZE_CLASS_STEP;
+  int cached = size - 1 < TCACHE_MAX_SIZE && thread_cache_usable(&thread_cache);
+  if (cached && thread_cache.bins[index])
+  {
+    return tcache_pop(&thread_cache, index);
+  }
+
+  pthread_mutex_lock(&arena->lock);
+  current_arena = arena;
+  // the objects other threads handed back may refill the cache
+  drain_remote_frees(arena, &thread_cache);
+  void *ptr = cached && thread_cache.bins[index] ? tcache_pop(&thread_cache, index) : arena_malloc(size, find_free_block);
+  pthread_mutex_unlock(&arena->lock);
+  if (ptr == NULL && arena != &arenas[0])
+  {
+    ptr = main_arena_memalign(BLOCK_ALIGN, size, find_free_block, NULL);
+  }
+  return ptr;
+}
+
+#define NO_ALIGNED_FIT ((size_t)-1)
+
+// Returns the offset from the header of the free block "block" to the header of the first block of "size" bytes
+// inside it whose writable area is aligned to "alignment", or NO_ALIGNED_FIT. A leading part must hold a block of its own
+size_t aligned_offset(meta_data block, size_t alignment, size_t size)
+{
+  uintptr_t writable = (uintptr_t)WRITABLE_AREA(block);
+  uintptr_t aligned = ALLING(writable, alignment);
+  if (aligned != writable && aligned - writable < MIN_BLOCK_SIZE)
+  {
+    aligned = ALLING(writable + MIN_BLOCK_SIZE, alignment);
+  }
+  size_t offset = aligned - writable;
+  if (offset + size > BLOCK_SIZE(block))
+  {
+    return NO_ALIGNED_FIT;
+  }
+  return offset;
+}
+
+// Searches the bins of the current arena for a free block that can hold an aligned block of "size" bytes,
+// starting with the bin of "size" itself. The offset of the aligned block is stored in "offset"
+meta_data find_aligned_block(size_t alignment, size_t size, size_t *offset)
+{
+  int index = bin_index(size);
+  uint64_t bins = free_bins_bitmap & (~0ULL << index);
+  while (bins)
+  {
+    index = __builtin_ctzll(bins);
+    for (meta_data current = free_bins[index]; current; current = FREE_LINKS(current)->next_free)
+    {
+      *offset = aligned_offset(current, alignment, size);
+      if (*offset != NO_ALIGNED_FIT)
+      {
+        return current;
+      }
+    }
+    bins &= bins - 1;
+  }
+  return NULL;
+}
+
+/**
+ * @brief Takes the aligned block at "offset" out of the free block "block".
+ *
+ * The leading part stays in the free pool as a block of its own.
+ *
+ * @return The aligned block, marked as allocated.
+ */
+meta_data carve_aligned_block(meta_data block, size_t offset)
+{
+  bin_remove(block);
+  if (offset == 0)
+  {
+    set_allocated(block);
+    return block;
+  }
+
+  meta_data aligned_block = (meta_data)((char *)block + offset);
+  aligned_block->size = BLOCK_SIZE(block) - offset;
+  set_allocated(aligned_block);
+  // the leading part goes back to the free pool
+  set_free(block, offset);
+  bin_insert(block);
+  return aligned_block;
+}
+
+/**
+ * @brief Allocates "size" bytes aligned to "alignment" from the current arena, whose lock must be held.
+ *
+ * The aligned block is carved out of an existing free block when one is
+ * large enough; otherwise the heap grows by a block with room for the
+ * alignment. Either way the leading part and the unused tail stay in the
+ * free pool, so nothing is lost to the alignment.
+ */
+void *arena_memalign(size_t alignment, size_t size, meta_data (*find_free_block)(meta_data *prev, size_t size))
+{
+  // every writable area is already BLOCK_ALIGN aligned
+  if (alignment <= BLOCK_ALIGN)
+  {
+    return arena_malloc(size, find_free_block);
+  }
+  if (size == 0 || size > SIZE_MAX / 2 - alignment)
+  {
+    return NULL;
+  }
+
+  size_t s = REQUEST_SIZE(size);
+  arena_stats.class_allocations[bin_index(s)]++;
+  size_t offset;
+  meta_data block = find_aligned_block(alignment, s, &offset);
+  if (block == NULL && quick_lists_count > 0)
+  {
+    // the parked blocks may merge into a large enough block
+    consolidate_quick_lists();
+    block = find_aligned_block(alignment, s, &offset);
+  }
+  if (block == NULL)
+  {
+    // the new memory needs room for a leading block in front of the aligned one
+    size_t allocate_size = heap_growth(s + alignment + MIN_BLOCK_SIZE);
+    meta_data mem = allocate_block(allocate_size);
+    if (mem == NULL)
+    {
+      return NULL;
+    }
+    // merging with a free tail of the heap may move the aligned block further to the front
+    block = merge_blocks(mem);
+    offset = aligned_offset(block, alignment, s);
+    if (offset == NO_ALIGNED_FIT)
+    {
+      return NULL;
+    }
+  }
+
+  block = carve_aligned_block(block, offset);
+  split_block(block, s);
+  current_arena->live_blocks++;
+  arena_stats.used_bytes += BLOCK_SIZE(block);
+  block_map_set(WRITABLE_AREA(block), 1);
+  return WRITABLE_AREA(block);
+}
+
+/**
+ * @brief Allocates a block of memory whose writable area is aligned to "alignment".
+ *
+ * The block works with every other function of the allocator, including
+ * custom_free and custom_realloc. A reallocated block keeps the alignment
+ * only as long as it is resized in place.
+ *
+ * @param alignment The requested alignment, a power of two.
+ * @param size The size of the memory block to allocate, in bytes.
+ * @param find_free_block A function pointer to find a free memory block.
+ * @return void* A pointer to the aligned memory block, or NULL if the allocation fails.
+ */
+void *untraced_memalign(size_t alignment, size_t size, meta_data (*find_free_block)(meta_data *prev, size_t size))
+{
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+  {
+    return NULL;
+  }
+  if (alignment <= BLOCK_ALIGN)
+  {
+    return untraced_malloc(size, find_free_block);
+  }
+  // the heap carves the block out of size + alignment bytes, custom_malloc would map a request that large
+  if (size > SIZE_MAX - alignment || size + alignment >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
+  {
+    return mmap_block_aligned(alignment, size);
+  }
+
+  struct arena *arena = get_thread_arena();
+  pthread_mutex_lock(&arena->lock);
+  current_arena = arena;
+  void *ptr = arena_memalign(alignment, size, find_free_block);
+  pthread_mutex_unlock(&arena->lock);
+  if (ptr == NULL && arena != &arenas[0])
+  {
+    ptr = main_arena_memalign(alignment, size, find_free_block, NULL);
+  }
+  return ptr;
+}
+
+/**
+ * @brief Allocates from the main arena for a thread whose arena has used up its reservation.
+ *
+ * Only the main arena adds heap segments mapped anywhere in the address
+ * space; a block of a secondary arena has to lie in its reservation, or
+ * arena_for_address() would not find its owner when it is freed.
+ *
+ * @param alignment The requested alignment, a power of two.
+ * @param size The size of the memory block to allocate, in bytes.
+ * @param find_free_block A function pointer to find a free memory block.
+ * @param fresh Receives where the memory fresh from the OS starts, see untraced_calloc(), unless NULL.
+ * @return void* A pointer to the memory block, or NULL if the allocation fails.
+ */
+void *main_arena_memalign(size_t alignment, size_t size, meta_data (*find_free_block)(meta_data *prev, size_t size), char **fresh)
+{
+  struct arena *arena = &arenas[0];
+  pthread_mutex_lock(&arena->lock);
+  current_arena = arena;
+  arena->fresh = NULL;
+  void *ptr = arena_memalign(alignment, size, find_free_block);
+  if (fresh)
+  {
+    *fresh = arena->fresh;
+  }
+  pthread_mutex_unlock(&arena->lock);
+  return ptr;
+}
+
+// C11 aligned_alloc: like custom_memalign, "alignment" must be a power of two
+void *custom_aligned_alloc(size_t alignment, size_t size, meta_data (*find_free_block)(meta_data *prev, size_t size))
+{
+  return custom_memalign(alignment, size, find_free_block);
+}
+
+/**
+ * @brief POSIX variant of custom_memalign that reports the reason of a failure.
+ *
+ * @param memptr Receives the aligned memory block, untouched on failure.
+ * @param alignment The requested alignment, a power of two and a multiple of sizeof(void *).
+ * @param size The size of the memory block to allocate, in bytes.
+ * @param find_free_block A function pointer to find a free memory block.
+ * @return 0 on success, EINVAL for an invalid alignment, ENOMEM if the allocation fails.
+ */
+int custom_posix_memalign(void **memptr, size_t alignment, size_t size, meta_data (*find_free_block)(meta_data *prev, size_t size))
+{
+  if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+  {
+    return EINVAL;
+  }
+  void *ptr = custom_memalign(alignment, size, find_free_block);
+  if (ptr == NULL)
+  {
+    return ENOMEM;
+  }
+  *memptr = ptr;
+  return 0;
+}
+
+// Returns the word of the slab page map holding the bit of page number "page", or NULL if there is none.
+// The leaf of the word is created if "create" is set
+uint64_t *page_map_word(uintptr_t page, int create)
+{
+  return radix_map_word(slab_page_map, PAGE_MAP_ROOT_SIZE, PAGE_MAP_LEAF_BITS, PAGE_MAP_LEAF_SIZE, page, create);
+}
+
+// This function checks in O(1) if "p" points into a slab, without touching the memory around "p"
+int is_slab_addr(void *p)
+{
+  uintptr_t page = (uintptr_t)p >> PAGE_SHIFT;
+  uint64_t *word = page_map_word(page, 0);
+  return word && ((__atomic_load_n(word, __ATOMIC_RELAXED) >> (page & 63)) & 1);
+}
+
+// This function checks if "p" is the start of a slot of its slab that was handed out before
+int is_slab_object(void *p)
+{
+  struct slab *slab = SLAB_OF(p);
+  char *first = (char *)slab + SLAB_HEADER_SIZE;
+  if ((char *)p < first)
+  {
+    return 0;
+  }
+  size_t offset = (char *)p - first;
+  // other threads carve while the freeing thread checks its pointer without their lock
+  return offset % slab->object_size == 0 && offset / slab->object_size < __atomic_load_n(&slab->carved, __ATOMIC_RELAXED);
+}
+
+// Unlinks a slab from the slabs with a free slot of its arena
+void slab_unlink(struct slab *slab)
+{
+  if (slab->prev)
+  {
+    slab->prev->next = slab->next;
+  }
+  else
+  {
+    slab->arena->slabs[slab->size_class] = slab->next;
+  }
+  if (slab->next)
+  {
+    slab->next->prev = slab->prev;
+  }
+  slab->next = NULL;
+  slab->prev = NULL;
+}
+
+// Puts a slab in front of the slabs with a free slot of its arena
+void slab_link(struct slab *slab)
+{
+  struct slab **head = &slab->arena->slabs[slab->size_class];
+  slab->prev = NULL;
+  slab->next = *head;
+  if (*head)
+  {
+    (*head)->prev = slab;
+  }
+  *head = slab;
+}
+
+/**
+ * @brief Creates an empty slab for objects of class "size_class" in the current arena, whose lock must be held.
+ *
+ * A slab kept in the empty slabs of the arena is reused first. Otherwise the
+ * slab is a new page aligned block of the heap, which is released like any
+ * other block once the slab is destroyed.
+ *
+ * @return The new slab, or NULL if the heap cannot grow.
+ */
+struct slab *slab_create(uint32_t size_class, meta_data (*find_free_block)(meta_data *prev, size_t size))
+{
+  struct slab *slab = current_arena->empty_slabs;
+  if (slab)
+  {
+    // the page is still marked as a slab, its carved count of zero rejects any stale pointer
+    current_arena->empty_slabs = slab->next;
+    current_arena->empty_slab_count--;
+  }
+  else
+  {
+    slab = arena_memalign(SLAB_SIZE, SLAB_SIZE, find_free_block);
+    if (slab == NULL)
+    {
+      return NULL;
+    }
+    uint64_t *word = page_map_word((uintptr_t)slab >> PAGE_SHIFT, 1);
+    if (word == NULL)
+    {
+      arena_free(slab);
+      return NULL;
+    }
+    __atomic_fetch_or(word, 1ULL << (((uintptr_t)slab >> PAGE_SHIFT) & 63), __ATOMIC_RELAXED);
+    current_arena->slab_pages++;
+    arena_stats.slab_bytes += BLOCK_SIZE(HEADER_AREA(slab));
+  }
+
+  slab->free_list = NULL;
+  slab->arena = current_arena;
+  slab->object_size = (size_class + 1) * SIZE_CLASS_STEP;
+  slab->size_class = size_class;
+  slab->capacity = (SLAB_SIZE - SLAB_HEADER_SIZE) / slab->object_size;
+  slab->used = 0;
+  __atomic_store_n(&slab->carved, 0, __ATOMIC_RELAXED);
+  slab_link(slab);
+  return slab;
+}
+
+// Gives a slab that is no longer linked anywhere back to the heap of its arena, whose lock must be held
+void slab_release(struct slab *slab)
+{
+  uint64_t *word = page_map_word((uintptr_t)slab >> PAGE_SHIFT, 0);
+  __atomic_fetch_and(word, ~(1ULL << (((uintptr_t)slab >> PAGE_SHIFT) & 63)), __ATOMIC_RELAXED);
+  if (slab->arena->slab_pages > 0)
+  {
+    slab->arena->slab_pages--;
+  }
+  slab->arena->stats.slab_bytes -= BLOCK_SIZE(HEADER_AREA(slab));
+  arena_free(slab);
+}
+
+// Keeps an empty slab for reuse or gives it back to the heap of its arena, whose lock must be held
+void slab_destroy(struct slab *slab)
+{
+  slab_unlink(slab);
+  struct arena *arena = slab->arena;
+  if (arena->empty_slab_count < SLAB_CACHE_MAX)
+  {
+    __atomic_store_n(&slab->carved, 0, __ATOMIC_RELAXED);
+    slab->next = arena->empty_slabs;
+    arena->empty_slabs = slab;
+    arena->empty_slab_count++;
+    return;
+  }
+
+  slab_release(slab);
+}
+
+// Gives every empty slab of the current arena back to its heap, whose lock must be held.
+// Called once the empty slabs are the only blocks left, which would otherwise keep the heap from shrinking
+void release_empty_slabs()
+{
+  // releasing the slabs must not trigger another pass
+  current_arena->slab_pages = 0;
+  for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+  {
+    while (current_arena->slabs[i])
+    {
+      struct slab *slab = current_arena->slabs[i];
+      slab_unlink(slab);
+      slab_release(slab);
+    }
+  }
+  while (current_arena->empty_slabs)
+  {
+    struct slab *slab = current_arena->empty_slabs;
+    current_arena->empty_slabs = slab->next;
+    slab_release(slab);
+  }
+  current_arena->empty_slab_count = 0;
+}
+
+// Releases the empty slabs of the current arena if nothing else is allocated from its heap
+void release_if_only_empty_slabs()
+{
+  if (current_arena->busy_slabs == 0 && current_arena->slab_pages > 0 && current_arena->live_blocks == current_arena->slab_pages)
+  {
+    release_empty_slabs();
+  }
+}
+
+/**
+ * @brief Allocates an object of at most SLAB_MAX_SIZE bytes from a slab of the current arena, whose lock must be held.
+ *
+ * Freed slots are reused first, then the untouched slots of the slab in
+ * order. A slab without free slots leaves the list of its class.
+ */
+void *slab_malloc(size_t size, meta_data (*find_free_block)(meta_data *prev, size_t size))
+{
+  uint32_t size_class = (size - 1) / SIZE_CLASS_STEP;
+  struct slab *slab = current_arena->slabs[size_class];
+  if (slab == NULL && (slab = slab_create(size_class, find_free_block)) == NULL)
+  {
+    return NULL;
+  }
+
+  if (slab->used == 0)
+  {
+    current_arena->busy_slabs++;
+  }
+  void *object = slab->free_list;
+  if (object)
+  {
+    slab->free_list = *(void **)object;
+  }
+  else
+  {
+    uint32_t carved = slab->carved;
+    __atomic_store_n(&slab->carved, carved + 1, __ATOMIC_RELAXED);
+    object = (char *)slab + SLAB_HEADER_SIZE + (size_t)carved * slab->object_size;
+  }
+  if (++slab->used == slab->capacity)
+  {
+    slab_unlink(slab);
+  }
+  arena_stats.slab_objects++;
+  arena_stats.slab_object_bytes += slab->object_size;
+  return object;
+}
+
+// Returns an object to its slab, the lock of the arena of the slab must be held.
+// Empty slabs go back to the heap, except the last one of their class
+void slab_free(void *ptr)
+{
+  if (!__atomic_load_n(&trusted_free, __ATOMIC_RELAXED) && !is_slab_object(ptr))
+    return;
+
+  struct slab *slab = SLAB_OF(ptr);
+  arena_stats.slab_objects--;
+  arena_stats.slab_object_bytes -= slab->object_size;
+  if (slab->used == slab->capacity)
+  {
+    slab_link(slab);
+  }
+  *(void **)ptr = slab->free_list;
+  slab->free_list = ptr;
+  if (--slab->used > 0)
+  {
+    return;
+  }
+  current_arena->busy_slabs--;
+  if (slab->next || slab->prev)
+  {
+    slab_destroy(slab);
+  }
+  release_if_only_empty_slabs();
+}
+
+// This function checks if a given pointer p is a valid memory address allocated by our custom memory allocator
+int is_valid_addr(void *p)
+{
+  if (is_slab_addr(p))
+  {
+    return is_slab_object(p);
+  }
+  // heap and mapped blocks are marked in the block map while they are handed out
+  return block_map_test(p);
+}
+
+// Returns the block of "ptr" to the current arena, whose lock must be held
+void arena_free(void *ptr)
+{
+  // check if the pointer is valid
+  if (!__atomic_load_n(&trusted_free, __ATOMIC_RELAXED) && !is_valid_addr(ptr))
+    return;
+
+  meta_data block = HEADER_AREA(ptr); // retrieves the metadata block for "ptr"
+  if (block->size & (BLOCK_FREE | BLOCK_QUICK))
+    return;
+
+  // in deferred coalescing mode small blocks are parked and merged later in a batch
+  if (BLOCK_SIZE(block) <= QUICK_MAX_SIZE && __atomic_load_n(&deferred_coalescing, __ATOMIC_RELAXED))
+  {
+    block->size |= BLOCK_QUICK;
+    block_map_set(ptr, 0);
+    current_arena->live_blocks--;
+    arena_stats.used_bytes -= BLOCK_SIZE(block);
+    arena_stats.quick_bytes += BLOCK_SIZE(block);
+    QUICK_NEXT(block) = quick_lists[BLOCK_SIZE(block) / BLOCK_ALIGN];
+    quick_lists[BLOCK_SIZE(block) / BLOCK_ALIGN] = block;
+    // once nothing but empty slabs is left, the parked blocks would keep the heap from shrinking
+    if (++quick_lists_count >= QUICK_THRESHOLD || current_arena->live_blocks == current_arena->slab_pages)
+    {
+      consolidate_quick_lists();
+      release_if_only_empty_slabs();
+    }
+    return;
+  }
+
+  // a large free coalesces the parked blocks first, like a fastbin consolidation, so that none of them is left
+  // between the freed block and the end of the heap when it is trimmed
+  if (quick_lists_count > 0 && BLOCK_SIZE(block) >= QUICK_CONSOLIDATE_SIZE)
+  {
+    consolidate_quick_lists();
+  }
+
+  block_map_set(ptr, 0);
+  current_arena->live_blocks--;
+  arena_stats.used_bytes -= BLOCK_SIZE(block);
+  size_t threshold = __atomic_load_n(&reclaim_threshold, __ATOMIC_RELAXED);
+  size_t reclaimed = threshold ? reclaimed_neighbours(block) : 0;
+  block = merge_blocks(block); // marks the memory block as available and merges adjacent free blocks
+
+  release_memory_if_required();
+  // a large block that was not trimmed away at the end of the heap gives its pages back once at least
+  // "threshold" bytes of it are resident, so that a hole growing by small blocks costs one madvise per threshold
+  if (threshold && heap_list_start && IS_FREE(block) && BLOCK_SIZE(block) > SMALL_BIN_MAX)
+  {
+    // a trimmed block lost the pages of its neighbours that lay past the new end of the heap
+    reclaimed = MIN(reclaimed, reclaimable_bytes(block));
+    RECLAIMED(block) = reclaimed;
+    current_arena->reclaimed += reclaimed;
+    if (BLOCK_SIZE(block) - reclaimed >= threshold)
+    {
+      reclaim_block(block);
+    }
+  }
+  release_if_only_empty_slabs();
+}
+
+// Returns the usable size of an object of the allocator, a slab object if "slab" is set and a block of the heap otherwise
+static inline size_t object_size(void *object, int slab)
+{
+  if (slab)
+  {
+    return SLAB_OF(object)->object_size;
+  }
+  // the flags of the header change when the neighbours of the block do
+  return (__atomic_load_n(&HEADER_AREA(object)->size, __ATOMIC_RELAXED) & ~(size_t)BLOCK_FLAGS) - META_DATA_SIZE;
+}
+
+// Frees an object of the current arena, whose lock must be held, or keeps it in "cache" if its bin has room
+void release_object(void *object, struct thread_cache *cache)
+{
+  int slab = is_slab_addr(object);
+  if (cache && thread_cache_usable(cache))
+  {
+    size_t index = object_size(object, slab) / SIZE_CLASS_STEP;
+    if (index < TCACHE_CLASS_COUNT && cache->counts[index] < TCACHE_BIN_MAX)
+    {
+      tcache_push(cache, index, object);
+      return;
+    }
+  }
+  if (slab)
+  {
+    slab_free(object);
+  }
+  else
+  {
+    arena_free(object);
+  }
+}
+
+// Frees the objects other threads handed over to "arena", the current arena whose lock must be held. Those that fit
+// go to "cache", which must be NULL unless it is the cache of a thread of the arena
+void drain_remote_frees(struct arena *arena, struct thread_cache *cache)
+{
+  if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL)
+  {
+    return;
+  }
+  void *object = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_ACQUIRE);
+  __atomic_store_n(&arena->remote_count, 0, __ATOMIC_RELAXED);
+  while (object)
+  {
+    void *next = *(void **)object;
+    release_object(object, cache);
+    object = next;
+  }
+}
+
+// Hands a batch of objects over to their arena without taking its lock. Any number of threads push while the thread
+// that locks the arena takes the whole list at once, so the list needs no protection against reuse of its nodes
+void remote_push(struct arena *arena, struct remote_batch *batch)
+{
+  void *head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+  do
+  {
+    *(void **)batch->tail = head;
+  } while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, batch->head, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  size_t waiting = __atomic_add_fetch(&arena->remote_count, batch->count, __ATOMIC_RELAXED);
+  batch->head = NULL;
+  batch->tail = NULL;
+  batch->count = 0;
+
+  // the threads of the arena may be idle or gone, the objects must not pile up forever
+  if (waiting >= REMOTE_DRAIN_LIMIT && pthread_mutex_trylock(&arena->lock) == 0)
+  {
+    current_arena = arena;
+    drain_remote_frees(arena, NULL);
+    pthread_mutex_unlock(&arena->lock);
+  }
+}
+
+/**
+ * @brief Gives the objects the calling thread cached back to their arenas.
+ *
+ * Objects a thread keeps in its cache, or has not handed over to their arena
+ * yet, still count as in use in the statistics and keep the heap from
+ * shrinking. Threads flush their cache when they exit.
+ */
+void custom_thread_cache_flush(void)
+{
+  struct thread_cache *cache = &thread_cache;
+  for (int i = 0; i < ARENA_COUNT; i++)
+  {
+    int pushed = cache->remote[i].count > 0;
+    if (pushed)
+    {
+      remote_push(&arenas[i], &cache->remote[i]);
+    }
+    // the threads of an arena may be gone, so what any thread handed over to it is freed here. Only the arenas this
+    // thread handed objects to are waited for, the others are drained if they are not busy
+    if (__atomic_load_n(&arenas[i].remote_frees, __ATOMIC_RELAXED) == NULL)
+    {
+      continue;
+    }
+    if (pushed)
+    {
+      pthread_mutex_lock(&arenas[i].lock);
+    }
+    else if (pthread_mutex_trylock(&arenas[i].lock) != 0)
+    {
+      continue;
+    }
+    current_arena = &arenas[i];
+    drain_remote_frees(&arenas[i], NULL);
+    pthread_mutex_unlock(&arenas[i].lock);
+  }
+  struct arena *arena = thread_arena;
+  if (arena == NULL)
+  {
+    return;
+  }
+  pthread_mutex_lock(&arena->lock);
+  current_arena = arena;
+  for (size_t index = 0; index < TCACHE_CLASS_COUNT; index++)
+  {
+    while (cache->bins[index])
+    {
+      release_object(tcache_pop(cache, index), NULL);
+    }
+  }
+  drain_remote_frees(arena, NULL);
+  pthread_mutex_unlock(&arena->lock);
+}
+
+pthread_key_t thread_cache_key;
+pthread_once_t thread_cache_once = PTHREAD_ONCE_INIT;
+
+// Flushes the cache of an exiting thread, whose later frees take the locks again
+void thread_cache_exit(void *unused)
+{
+  (void)unused;
+  thread_cache.state = -1;
+  custom_thread_cache_flush();
+}
+
+void create_thread_cache_key(void)
+{
+  pthread_key_create(&thread_cache_key, thread_cache_exit);
+}
+
+/**
+ * @brief Takes an object freed by the calling thread into its cache.
+ *
+ * Objects of the arena of the thread are cached, a full bin first gives half
+ * of its objects back under one lock. Objects of another arena are gathered
+ * and handed over to it in batches. Blocks beyond TCACHE_MAX_SIZE are left to
+ * the caller either way.
+ *
+ * @param ptr The object, already checked to be a block of the heap unless it is a slab object.
+ * @param arena The arena "ptr" belongs to.
+ * @param slab Non-zero if "ptr" is a slab object.
+ * @return 1 if the object was taken care of, 0 if the caller has to free it.
+ */
+int thread_cache_free(void *ptr, struct arena *arena, int slab)
+{
+  struct thread_cache *cache = &thread_cache;
+  if (!thread_cache_usable(cache))
+  {
+    return 0;
+  }
+  int trusted = __atomic_load_n(&trusted_free, __ATOMIC_RELAXED);
+  if (slab && !trusted && !is_slab_object(ptr))
+  {
+    return 1;
+  }
+  // larger blocks are freed under the lock of their arena right away, like without a cache
+  size_t index = object_size(ptr, slab) / SIZE_CLASS_STEP;
+  if (index >= TCACHE_CLASS_COUNT)
+  {
+    return 0;
+  }
+  if (cache->state == 0)
+  {
+    // pthread_setspecific() may allocate, the state is set first
+    cache->state = 1;
+    pthread_once(&thread_cache_once, create_thread_cache_key);
+    pthread_setspecific(thread_cache_key, cache);
+  }
+
+  struct arena *own = get_thread_arena();
+  if (arena != own)
+  {
+    struct remote_batch *batch = &cache->remote[arena - arenas];
+    if (!trusted && ((void **)ptr)[1] == cache)
+    {
+      for (void *object = batch->head; object; object = *(void **)object)
+      {
+        if (object == ptr)
+        {
+          return 1;
+        }
+      }
+    }
+    ((void **)ptr)[1] = cache;
+    *(void **)ptr = batch->head;
+    if (batch->tail == NULL)
+    {
+      batch->tail = ptr;
+    }
+    batch->head = ptr;
+    if (++batch->count >= REMOTE_FREE_BATCH)
+    {
+      remote_push(arena, batch);
+    }
+    return 1;
+  }
+
+  if (!trusted && ((void **)ptr)[1] == cache)
+  {
+    // most likely freed twice, the bin tells for sure
+    for (void *object = cache->bins[index]; object; object = *(void **)object)
+    {
+      if (object == ptr)
+      {
+        return 1;
+      }
+    }
+  }
+  if (cache->counts[index] >= TCACHE_BIN_MAX)
+  {
+    pthread_mutex_lock(&own->lock);
+    current_arena = own;
+    drain_remote_frees(own, cache);
+    while (cache->counts[index] > TCACHE_BIN_MAX / 2)
+    {
+      release_object(tcache_pop(cache, index), NULL);
+    }
+    pthread_mutex_unlock(&own->lock);
+  }
+  tcache_push(cache, index, ptr);
+  return 1;
+}
+
+/**
+ * @brief Frees the memory space pointed to by ptr, which must have been returned by a previous call to custom_malloc, custom_calloc, or custom_realloc.
+ *
+ * This function does not return a value. The memory space is made available for future allocations
+ * of the arena that owns it, whichever thread frees it.
+ *
+ * @param ptr Pointer to the memory block to be freed. If ptr is NULL, no operation is performed.
+ * @param size The size "ptr" was allocated with, or 0 if unknown.
+ */
+void untraced_free_sized(void *ptr, size_t size)
+{
+  if (ptr == NULL)
+    return;
+
+  // the header in front of a slab object belongs to its neighbour, so slabs are checked first.
+  // Slab objects are never larger than SLAB_MAX_SIZE, so a larger size rules the page map lookup out
+  if ((size == 0 || size <= SLAB_MAX_SIZE) && is_slab_addr(ptr))
+  {
+    struct arena *arena = arena_for_address(ptr);
+    if (thread_cache_free(ptr, arena, 1))
+    {
+      return;
+    }
+    pthread_mutex_lock(&arena->lock);
+    current_arena = arena;
+    slab_free(ptr);
+    pthread_mutex_unlock(&arena->lock);
+    return;
+  }
+
+  // pointers the allocator did not hand out are ignored before the memory around them is touched
+  if (!__atomic_load_n(&trusted_free, __ATOMIC_RELAXED) && !block_map_test(ptr))
+    return;
+
+  // directly mapped blocks are unmapped right away
+  if (__atomic_load_n(&HEADER_AREA(ptr)->size, __ATOMIC_RELAXED) & BLOCK_MMAPPED)
+  {
+    munmap_block(ptr);
+    return;
+  }
+
+  struct arena *arena = arena_for_address(ptr);
+  if (thread_cache_free(ptr, arena, 0))
+  {
+    return;
+  }
+  pthread_mutex_lock(&arena->lock);
+  current_arena = arena;
+  arena_free(ptr);
+  pthread_mutex_unlock(&arena->lock);
+}
+
+void untraced_free(void *ptr)
+{
+  untraced_free_sized(ptr, 0);
+}
+
+// Returns the number of bytes that can be written at "ptr", which must have been returned by the allocator
+size_t custom_usable_size(void *ptr)
+{
+  if (ptr == NULL)
+  {
+    return 0;
+  }
+  if (is_slab_addr(ptr))
+  {
+    return SLAB_OF(ptr)->object_size;
+  }
+  return USABLE_SIZE(HEADER_AREA(ptr));
+}
+
+/**
+ * @brief Resizes an allocated block without moving it, the lock of the current arena must be held.
+ *
+ * A block that shrinks gives its unused tail back with split_block. A block
+ * that grows absorbs a free successor and, when it is the last block of the
+ * heap, extends the heap behind it.
+ *
+ * @param block The allocated block to be resized.
+ * @param size The new size of the writable area, in bytes.
+ * @return 1 if the block now holds "size" bytes, 0 if it has to be moved.
+ */
+int resize_block_in_place(meta_data block, size_t size)
+{
+  size_t s = REQUEST_SIZE(size);
+  if (BLOCK_SIZE(block) >= s)
+  {
+    split_block(block, s);
+    release_memory_if_required();
+    return 1;
+  }
+
+  meta_data next = NEXT_BLOCK(block);
+  // absorb the free successor if it is enough or if the heap can grow behind it
+  if (IS_FREE(next) && (BLOCK_SIZE(block) + BLOCK_SIZE(next) >= s || NEXT_BLOCK(next) == heap_list_fence))
+  {
+    bin_remove(next);
+    if (last_allocated == next)
+    {
+      last_allocated = block;
+    }
+    block->size += BLOCK_SIZE(next);
+    next = NEXT_BLOCK(block);
+    set_prev_free(next, 0);
+  }
+
+  if (BLOCK_SIZE(block) < s && next == heap_list_fence && arena_top_is(current_arena, (char *)next + FENCE_SIZE))
+  {
+    size_t increment = ALLING(s - BLOCK_SIZE(block), PAGE_SIZE);
+    void *memory = arena_sbrk(current_arena, increment);
+    if (memory == (char *)next + FENCE_SIZE)
+    {
+      // the fence moves to the new end of the heap
+      block->size += increment;
+      meta_data new_fence = NEXT_BLOCK(block);
+      new_fence->size = 0;
+      FENCE_NEXT(new_fence) = NULL;
+      heap_list_fence = new_fence;
+    }
+    else if (memory != (void *)-1)
+    {
+      // someone else moved the break in between, keep the new memory as a free block
+      meta_data fresh = add_block_to_heap(memory, increment);
+      if (fresh)
+      {
+        merge_blocks(fresh);
+      }
+    }
+  }
+
+  if (BLOCK_SIZE(block) < s)
+  {
+    return 0;
+  }
+  split_block(block, s);
+  return 1;
+}
+
+// This function resizes a previously allocated memory block. It grows or shrinks the block in place
+// when possible and moves it to a new location otherwise
+STRATEGY_TEMPLATE void *untraced_realloc(void *ptr, size_t size, meta_data find_free_block(meta_data *prev, size_t size))
+{
+  // If "ptr" is NULL, realloc() behaves like malloc(size)
+  if (!ptr)
+  {
+    return untraced_malloc(size, find_free_block);
+  }
+  meta_data block = HEADER_AREA(ptr);
+  size_t old_size;
+  if (is_slab_addr(ptr))
+  {
+    if (!is_slab_object(ptr))
+    {
+      return NULL;
+    }
+    // slab objects keep their slot as long as the new size fits
+    old_size = SLAB_OF(ptr)->object_size;
+    if (size <= old_size)
+    {
+      return ptr;
+    }
+  }
+  else if (!block_map_test(ptr))
+  {
+    return NULL;
+  }
+  else if (__atomic_load_n(&block->size, __ATOMIC_RELAXED) & BLOCK_MMAPPED)
+  {
+    if (!is_valid_addr(ptr))
+    {
+      return NULL;
+    }
+    old_size = USABLE_SIZE(block);
+    // If the existing block is large enough, return the same block
+    if (old_size >= size)
+    {
+      return ptr;
+    }
+  }
+  else
+  {
+    struct arena *arena = arena_for_address(ptr);
+    pthread_mutex_lock(&arena->lock);
+    current_arena = arena;
+    int valid = is_valid_addr(ptr);
+    size_t block_size = BLOCK_SIZE(block);
+    // blocks growing past the mmap threshold are moved out of the heap
+    int resized = valid && (size <= USABLE_SIZE(block) || size < __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) &&
+                  resize_block_in_place(block, size ? size : 1);
+    if (valid)
+    {
+      arena_stats.used_bytes += BLOCK_SIZE(block) - block_size;
+    }
+    pthread_mutex_unlock(&arena->lock);
+    if (!valid)
+    {
+      return NULL;
+    }
+    if (resized)
+    {
+      return ptr;
+    }
+    old_size = USABLE_SIZE(block);
+  }
+
+  void *new_ptr;
+  // If the block is too small, allocate a new one with the requested size
+  new_ptr = untraced_malloc(size, find_free_block);
+  if (!new_ptr)
+  {
+    return NULL;
+  }
+  memcpy(new_ptr, ptr, old_size < size ? old_size : size); // Copy the data from the old block to the new block
+  untraced_free(ptr);                                      // Free the old block
+  return new_ptr;
+}
+
+// This function allocates memory for an array and initializes it to zero
+//@param "nelem" number of elements and "elsize" size of each element
+// Memory fresh from the OS is already zero: mapped blocks and blocks carved from the pages the heap just grew by
+// are not cleared again
+STRATEGY_TEMPLATE void *untraced_calloc(size_t nelem, size_t elsize, meta_data find_free_block(meta_data *prev, size_t size))
+{
+  size_t size;
+  // the total size of the array may not fit in a size_t
+  if (__builtin_mul_overflow(nelem, elsize, &size))
+  {
+    return NULL;
+  }
+  if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
+  {
+    return mmap_block(size);
+  }
+  if (size <= __atomic_load_n(&slab_max_size, __ATOMIC_RELAXED))
+  {
+    void *ptr = untraced_malloc(size, find_free_block);
+    if (ptr)
+    {
+      memset(ptr, 0, size);
+    }
+    return ptr;
+  }
+
+  struct arena *arena = get_thread_arena();
+  pthread_mutex_lock(&arena->lock);
+  current_arena = arena;
+  arena->fresh = NULL;
+  void *ptr = arena_malloc(size, find_free_block);
+  // set only if the block was carved from a heap growth
+  char *fresh = arena->fresh;
+  pthread_mutex_unlock(&arena->lock);
+  if (ptr == NULL && arena != &arenas[0])
+  {
+    ptr = main_arena_memalign(BLOCK_ALIGN, size, find_free_block, &fresh);
+  }
+  if (ptr)
+  {
+    // only the part below the new pages can hold old data
+    size_t dirty = size;
+    if (fresh)
+    {
+      meta_data block = HEADER_AREA(ptr);
+      dirty = fresh <= (char *)ptr ? 0 : MIN((size_t)(fresh - (char *)ptr), size);
+      // the growth path linked the new block into a bin before handing it out, and wrote its footer if it was not
+      // split, so those words hold pointers and sizes even above the fresh pages
+      dirty = MAX(dirty, MIN((size_t)((char *)(&RECLAIMED(block) + 1) - (char *)ptr), size));
+      char *footer = (char *)&FOOTER(block);
+      if (footer < (char *)ptr + size)
+      {
+        memset(footer, 0, (char *)ptr + size - footer);
+      }
+    }
+    memset(ptr, 0, dirty);
+  }
+  return ptr;
+}
+
+// Takes a chunk of at least "size" bytes from the heap, or NULL if the heap is exhausted
+struct region_chunk *region_chunk_create(size_t size, meta_data (*find_free_block)(meta_data *prev, size_t size))
+{
+  struct region_chunk *chunk = custom_malloc(REGION_CHUNK_HEADER_SIZE + size, find_free_block);
+  if (chunk == NULL)
+  {
+    return NULL;
+  }
+  chunk->next = NULL;
+  // the slack the heap rounded the block up with is usable as well
+  chunk->size = (custom_usable_size(chunk) - REGION_CHUNK_HEADER_SIZE) & ~(size_t)(BLOCK_ALIGN - 1);
+  return chunk;
+}
+
+/**
+ * @brief Creates a region, whose objects are allocated by bumping a pointer and freed all at once.
+ *
+ * The region takes its chunks from the heap of the calling thread. The region
+ * itself lives in its first chunk, so creating it costs a single allocation.
+ *
+ * @param chunk_size Size of the chunks taken from the heap, 0 for REGION_CHUNK_SIZE.
+ * @param find_free_block A function pointer to find a free memory block for the chunks.
+ * @return struct custom_arena* The region, or NULL if the allocation fails.
+ */
+struct custom_arena *custom_arena_create(size_t chunk_size, meta_data find_free_block(meta_data *prev, size_t size))
+{
+  if (chunk_size == 0)
+  {
+    chunk_size = REGION_CHUNK_SIZE;
+  }
+  size_t arena_size = ALLING(sizeof(struct custom_arena), BLOCK_ALIGN);
+  if (chunk_size > SIZE_MAX / 2)
+  {
+    return NULL;
+  }
+  struct region_chunk *chunk = region_chunk_create(arena_size + chunk_size, find_free_block);
+  if (chunk == NULL)
+  {
+    return NULL;
+  }
+  struct custom_arena *arena = (struct custom_arena *)REGION_CHUNK_START(chunk);
+  arena->first = chunk;
+  arena->chunk_size = chunk_size;
+  arena->find_free_block = find_free_block;
+  custom_arena_reset(arena);
+  return arena;
+}
+
+// Moves the region to a chunk with at least "size" free bytes, reusing the chunk after the current one if it is
+// large enough. Returns 0 if the heap is exhausted
+int region_next_chunk(struct custom_arena *arena, size_t size)
+{
+  struct region_chunk *chunk = arena->current->next;
+  if (chunk == NULL || chunk->size < size)
+  {
+    chunk = region_chunk_create(MAX(arena->chunk_size, size), arena->find_free_block);
+    if (chunk == NULL)
+    {
+      return 0;
+    }
+    // a smaller chunk that was skipped stays after the new one, for the allocations to come
+    chunk->next = arena->current->next;
+    arena->current->next = chunk;
+  }
+  arena->current = chunk;
+  arena->cursor = REGION_CHUNK_START(chunk);
+  arena->end = arena->cursor + chunk->size;
+  return 1;
+}
+
+/**
+ * @brief Allocates "size" bytes from a region.
+ *
+ * The memory is aligned like the one of custom_malloc. It is only given back by
+ * custom_arena_reset or custom_arena_destroy, it must not be passed to custom_free.
+ *
+ * @param arena The region.
+ * @param size The size of the memory block to allocate, in bytes.
+ * @return void* A pointer to the allocated memory, or NULL if the allocation fails.
+ */
+void *custom_arena_alloc(struct custom_arena *arena, size_t size)
+{
+  if (size > SIZE_MAX / 2)
+  {
+    return NULL;
+  }
+  size_t s = ALLING(size ? size : 1, BLOCK_ALIGN);
+  if (s > (size_t)(arena->end - arena->cursor) && !region_next_chunk(arena, s))
+  {
+    return NULL;
+  }
+  void *ptr = arena->cursor;
+  arena->cursor += s;
+  return ptr;
+}
+
+// Frees every object of a region at once in O(1), the region keeps its chunks for the allocations to come
+void custom_arena_reset(struct custom_arena *arena)
+{
+  arena->current = arena->first;
+  arena->cursor = (char *)arena + ALLING(sizeof(struct custom_arena), BLOCK_ALIGN);
+  arena->end = REGION_CHUNK_START(arena->first) + arena->first->size;
+}
+
+// Gives every chunk of a region back to the heap, the region itself included
+void custom_arena_destroy(struct custom_arena *arena)
+{
+  struct region_chunk *chunk = arena->first;
+  while (chunk)
+  {
+    struct region_chunk *next = chunk->next;
+    custom_free(chunk);
+    chunk = next;
+  }
+}
+
+// Returns the size of the largest free block of the current arena, whose lock must be held
+size_t largest_free_block()
+{
+  // the tree holds every free block beyond the small bins, its rightmost block is the largest
+  meta_data current = free_tree_root;
+  if (current)
+  {
+    while (TREE_LINKS(current)->right)
+    {
+      current = TREE_LINKS(current)->right;
+    }
+    return BLOCK_SIZE(current);
+  }
+  // every small bin holds a single size
+  uint64_t small_bins = free_bins_bitmap & ((1ULL << SMALL_BIN_COUNT) - 1);
+  if (small_bins == 0)
+  {
+    return 0;
+  }
+  return (size_t)(64 - __builtin_clzll(small_bins)) * SIZE_CLASS_STEP;
+}
+
+/**
+ * @brief Takes a snapshot of the allocator statistics.
+ *
+ * The statistics come from counters the allocator keeps up to date as it
+ * runs, no heap is walked. Each arena is locked just long enough to copy its
+ * counters, so the snapshot is consistent per arena but not across arenas.
+ * Objects waiting in a thread cache or for their arena count as in use, see
+ * custom_thread_cache_flush().
+ *
+ * @param stats Receives the snapshot.
+ */
+void custom_alloc_stats(struct custom_alloc_stats *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+  size_t search_steps[FIT_COUNT] = {0};
+  size_t free_block_bytes = 0;
+  // largest_free_block works on the current arena, the caller's arena is restored afterwards
+  struct arena *thread_arena = current_arena;
+
+  for (int i = 0; i < ARENA_COUNT; i++)
+  {
+    struct arena *arena = &arenas[i];
+    pthread_mutex_lock(&arena->lock);
+    current_arena = arena;
+    stats->heap_bytes += arena->stats.heap_bytes;
+    // the blocks holding slabs count through their objects and free slots
+    stats->in_use_bytes += arena->stats.used_bytes - arena->stats.slab_bytes + arena->stats.slab_object_bytes;
+    stats->free_bytes += arena->stats.free_bytes + arena->stats.quick_bytes + arena->stats.slab_bytes - arena->stats.slab_object_bytes;
+    stats->reclaimed_bytes += arena->reclaimed;
+    stats->allocated_blocks += arena->live_blocks - arena->slab_pages + arena->stats.slab_objects;
+    stats->free_blocks += arena->stats.free_blocks;
+    stats->slab_objects += arena->stats.slab_objects;
+    stats->sbrk_calls += arena->stats.sbrk_calls;
+    stats->brk_calls += arena->stats.brk_calls;
+    free_block_bytes += arena->stats.free_bytes;
+    size_t largest = largest_free_block();
+    if (largest > stats->largest_free_block)
+    {
+      stats->largest_free_block = largest;
+    }
+    for (int fit = 0; fit < FIT_COUNT; fit++)
+    {
+      stats->searches[fit] += arena->stats.searches[fit];
+      search_steps[fit] += arena->stats.search_steps[fit];
+    }
+    for (int bin = 0; bin < BIN_COUNT; bin++)
+    {
+      stats->class_allocations[bin] += arena->stats.class_allocations[bin];
+    }
+    pthread_mutex_unlock(&arena->lock);
+  }
+  current_arena = thread_arena;
+
+  pthread_mutex_lock(&mmap_lock);
+  stats->mapped_bytes = mmap_bytes;
+  stats->mapped_blocks = mmap_blocks;
+  pthread_mutex_unlock(&mmap_lock);
+  stats->in_use_bytes += stats->mapped_bytes;
+  stats->allocated_blocks += stats->mapped_blocks;
+
+  stats->fragmentation = free_block_bytes ? 1.0 - (double)stats->largest_free_block / free_block_bytes : 0.0;
+  for (int fit = 0; fit < FIT_COUNT; fit++)
+  {
+    stats->average_search_length[fit] = stats->searches[fit] ? (double)search_steps[fit] / stats->searches[fit] : 0.0;
+  }
+}
+
+// Writes out the records gathered in trace_buffer, trace_lock must be held
+void trace_flush()
+{
+  size_t written = 0;
+  while (written < trace_buffer_used)
+  {
+    ssize_t n = write(trace_fd, trace_buffer + written, trace_buffer_used - written);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      // the trace is incomplete from here on, there is nobody to report it to
+      break;
+    }
+    written += n;
+  }
+  trace_buffer_used = 0;
+}
+
+// Appends a record to the trace, trace_lock must be held
+void trace_record(enum trace_op op, void *ptr, uint64_t old_ptr, size_t size)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  struct trace_record record = {
+      .time = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec - trace_start_time,
+      .ptr = (uintptr_t)ptr,
+      .old_ptr = old_ptr,
+      .size = size,
+      .op = op,
+  };
+  if (trace_buffer_used + sizeof(record) > TRACE_BUFFER_SIZE)
+  {
+    trace_flush();
+  }
+  memcpy(trace_buffer + trace_buffer_used, &record, sizeof(record));
+  trace_buffer_used += sizeof(record);
+}
+
+static inline int tracing()
+{
+  return __atomic_load_n(&trace_fd, __ATOMIC_RELAXED) >= 0;
+}
+
+/**
+ * @brief Starts recording every allocator call into a trace file.
+ *
+ * The file starts with TRACE_MAGIC, followed by one struct trace_record per
+ * call of custom_malloc, custom_free, custom_realloc, custom_calloc and
+ * custom_memalign. Records are buffered and written with write(2), so tracing
+ * never allocates. While a trace runs the traced calls are serialized, which
+ * keeps the records in the order the operations happened.
+ *
+ * @param path File to write, truncated if it exists.
+ * @return 0 on success, -1 with errno set otherwise.
+ */
+int custom_trace_start(const char *path)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  pthread_mutex_lock(&trace_lock);
+  if (trace_fd >= 0)
+  {
+    pthread_mutex_unlock(&trace_lock);
+    close(fd);
+    errno = EBUSY;
+    return -1;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  trace_start_time = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+  memcpy(trace_buffer, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1);
+  trace_buffer_used = sizeof(TRACE_MAGIC) - 1;
+  __atomic_store_n(&trace_fd, fd, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&trace_lock);
+
+  // records still in the buffer at exit are flushed
+  static int registered = 0;
+  if (!registered)
+  {
+    registered = 1;
+    atexit(custom_trace_stop);
+  }
+  return 0;
+}
+
+// Flushes the trace and closes its file, does nothing if no trace is running
+void custom_trace_stop(void)
+{
+  pthread_mutex_lock(&trace_lock);
+  if (trace_fd >= 0)
+  {
+    trace_flush();
+    close(trace_fd);
+    __atomic_store_n(&trace_fd, -1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+// Marks or unmarks the sampled allocation "ptr" in the profile map. Objects of different arenas may share a word of
+// the map and their samples are taken without a lock, hence the atomic updates
+void profile_map_set(void *ptr, int sampled)
+{
+  uintptr_t index = (uintptr_t)ptr >> BLOCK_ALIGN_SHIFT;
+  uint64_t *word = radix_map_word(profile_map, BLOCK_MAP_ROOT_SIZE, BLOCK_MAP_LEAF_BITS, BLOCK_MAP_LEAF_SIZE, index, sampled);
+  if (word == NULL)
+  {
+    return;
+  }
+  uint64_t bit = (uint64_t)1 << (index & 63);
+  if (sampled)
+  {
+    __atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+  }
+  else
+  {
+    __atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED);
+  }
+}
+
+static inline size_t profile_slot(size_t capacity, uint64_t ptr)
+{
+  // sampled blocks lie BLOCK_ALIGN apart at least, the bits taken from the middle of the product mix in every bit above
+  return (size_t)((ptr * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
+}
+
+// Puts a sample into the table, whose capacity leaves room for it; profile_lock must be held
+void profile_put(const struct profile_sample *sample)
+{
+  size_t slot = profile_slot(profile_capacity, sample->ptr);
+  while (profile_table[slot].ptr != 0 && profile_table[slot].ptr != sample->ptr)
+  {
+    slot = (slot + 1) & (profile_capacity - 1);
+  }
+  profile_count += profile_table[slot].ptr == 0;
+  profile_table[slot] = *sample;
+}
+
+// Doubles the table of samples, which is mapped directly so that the profiler never allocates through itself.
+// profile_lock must be held. Returns -1 if there is no memory for it
+int profile_grow(void)
+{
+  size_t capacity = profile_capacity ? profile_capacity * 2 : PROFILE_TABLE_MIN_SIZE;
+  struct profile_sample *table = mmap(NULL, capacity * sizeof(struct profile_sample), PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (table == MAP_FAILED)
+  {
+    return -1;
+  }
+  struct profile_sample *old = profile_table;
+  size_t old_capacity = profile_capacity;
+  profile_capacity = capacity;
+  profile_count = 0;
+  __atomic_store_n(&profile_table, table, __ATOMIC_RELAXED);
+  for (size_t i = 0; i < old_capacity; i++)
+  {
+    if (old[i].ptr != 0)
+    {
+      profile_put(&old[i]);
+    }
+  }
+  if (old)
+  {
+    munmap(old, old_capacity * sizeof(struct profile_sample));
+  }
+  return 0;
+}
+
+// Draws the bytes until the next sample of the thread from an exponential distribution of mean "interval", so that
+// the samples form a Poisson process over the allocated bytes and every byte is equally likely to be sampled
+static inline intptr_t profile_next_countdown(size_t interval)
+{
+  if (profile_random == 0)
+  {
+    profile_random = (((uintptr_t)&profile_random * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)time(NULL)) | 1;
+  }
+  profile_random ^= profile_random << 13;
+  profile_random ^= profile_random >> 7;
+  profile_random ^= profile_random << 17;
+  double u = (double)((profile_random >> 11) + 1) / (double)(1ULL << 53);
+  double countdown = -log(u) * (double)interval;
+  return countdown < 1 ? 1 : countdown > INTPTR_MAX / 2 ? INTPTR_MAX / 2 : (intptr_t)countdown;
+}
+
+// Slow path of profiled(): records "ptr" with the stack of its caller and draws the next countdown of the thread.
+// Kept out of line, so that its frame is the one to skip
+__attribute__((noinline)) void profile_sample(void *ptr, size_t size)
+{
+  size_t interval = __atomic_load_n(&profile_interval, __ATOMIC_RELAXED);
+  // the countdown is rearmed first, the allocations of backtrace() must not sample again
+  profile_countdown = interval ? profile_next_countdown(interval) : PROFILE_IDLE_COUNTDOWN;
+  if (interval == 0 || ptr == NULL)
+  {
+    return;
+  }
+  void *frames[PROFILE_MAX_DEPTH + 1];
+  int depth = backtrace(frames, PROFILE_MAX_DEPTH + 1);
+  struct profile_sample sample = {.ptr = (uintptr_t)ptr, .size = size, .depth = depth > 1 ? depth - 1 : 0};
+  memcpy(sample.stack, frames + 1, sample.depth * sizeof(void *));
+
+  pthread_mutex_lock(&profile_lock);
+  if (2 * (profile_count + 1) <= profile_capacity || profile_grow() == 0)
+  {
+    profile_put(&sample);
+    profile_map_set(ptr, 1);
+  }
+  pthread_mutex_unlock(&profile_lock);
+}
+
+// Charges an allocation of "size" bytes to the countdown of the calling thread and samples it once the countdown runs
+// out. Costs a single decrement unless it does, see custom_profile_start()
+static inline __attribute__((always_inline)) void *profiled(void *ptr, size_t size)
+{
+  if (__builtin_expect((profile_countdown -= (intptr_t)size) < 0, 0))
+  {
+    profile_sample(ptr, size);
+  }
+  return ptr;
+}
+
+// Removes "ptr" from the table of samples if it was sampled. Must run before "ptr" is freed, or another thread may
+// sample the same address in between
+static inline void profile_free(void *ptr)
+{
+  if (__builtin_expect(__atomic_load_n(&profile_table, __ATOMIC_RELAXED) == NULL, 1) || ptr == NULL ||
+      ((uintptr_t)ptr & (BLOCK_ALIGN - 1)))
+  {
+    return;
+  }
+  uintptr_t index = (uintptr_t)ptr >> BLOCK_ALIGN_SHIFT;
+  uint64_t *word = radix_map_word(profile_map, BLOCK_MAP_ROOT_SIZE, BLOCK_MAP_LEAF_BITS, BLOCK_MAP_LEAF_SIZE, index, 0);
+  if (word == NULL || !((__atomic_load_n(word, __ATOMIC_RELAXED) >> (index & 63)) & 1))
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&profile_lock);
+  size_t slot = profile_slot(profile_capacity, (uintptr_t)ptr);
+  while (profile_table[slot].ptr != 0 && profile_table[slot].ptr != (uintptr_t)ptr)
+  {
+    slot = (slot + 1) & (profile_capacity - 1);
+  }
+  if (profile_table[slot].ptr != 0)
+  {
+    profile_table[slot].ptr = 0;
+    profile_count--;
+    // shifts the following entries back, so that no lookup stops early at the hole
+    size_t hole = slot;
+    for (size_t next = (slot + 1) & (profile_capacity - 1); profile_table[next].ptr != 0;
+         next = (next + 1) & (profile_capacity - 1))
+    {
+      size_t home = profile_slot(profile_capacity, profile_table[next].ptr);
+      if (((next - home) & (profile_capacity - 1)) >= ((next - hole) & (profile_capacity - 1)))
+      {
+        profile_table[hole] = profile_table[next];
+        profile_table[next].ptr = 0;
+        hole = next;
+      }
+    }
+  }
+  profile_map_set(ptr, 0);
+  pthread_mutex_unlock(&profile_lock);
+}
+
+/**
+ * @brief Starts or stops sampling allocations with their call stack.
+ *
+ * Each thread counts down the bytes it allocates and samples the allocation
+ * that makes its countdown run out, then draws the next countdown from an
+ * exponential distribution of mean "interval". An allocation of n bytes is
+ * so sampled with probability 1 - exp(-n / interval), which lets
+ * custom_profile_dump() scale the samples back to the whole heap. Live samples
+ * are kept in a table mapped aside from the heaps and leave it when they are
+ * freed. Allocations that are not sampled only pay for the decrement.
+ *
+ * A thread notices a start within PROFILE_IDLE_COUNTDOWN allocated bytes.
+ * Stopping keeps the live samples, so they can still be dumped.
+ *
+ * @param interval Mean bytes between two samples, 0 stops sampling.
+ */
+void custom_profile_start(size_t interval)
+{
+  if (interval)
+  {
+    // the first backtrace() loads the unwinder, which allocates; better here than while sampling
+    void *frame;
+    backtrace(&frame, 1);
+  }
+  __atomic_store_n(&profile_interval, MIN(interval, (size_t)INTPTR_MAX / 2), __ATOMIC_RELAXED);
+  profile_countdown = 0;
+}
+
+// Orders samples by their stack, so that the samples of a call site follow each other
+int compare_profile_stacks(const void *a, const void *b)
+{
+  const struct profile_sample *x = a;
+  const struct profile_sample *y = b;
+  if (x->depth != y->depth)
+  {
+    return x->depth < y->depth ? -1 : 1;
+  }
+  return memcmp(x->stack, y->stack, x->depth * sizeof(void *));
+}
+
+// Writes the name of the function "symbol" from backtrace_symbols() points into, or "address" if it has none
+void write_frame_name(int fd, const char *symbol, void *address)
+{
+  const char *name = symbol ? strchr(symbol, '(') : NULL;
+  size_t length = name ? strcspn(name + 1, "+)") : 0;
+  if (length == 0)
+  {
+    dprintf(fd, "%p", address);
+    return;
+  }
+  dprintf(fd, "%.*s", (int)length, name + 1);
+}
+
+/**
+ * @brief Writes the live sampled allocations, grouped by call stack.
+ *
+ * PROFILE_PPROF writes the legacy heap profile text format of gperftools,
+ * which pprof reads and scales by the sampling interval on its own, followed
+ * by the memory map of the process so it can symbolize the addresses:
+ *   pprof --text ./program heap.prof
+ * Freed samples are not kept, so the allocated columns repeat the live ones.
+ *
+ * PROFILE_COLLAPSED writes one line per stack, its frames from the outermost
+ * in, separated by ';', then the estimated live bytes, as flamegraph.pl takes
+ * them. Functions are named from the dynamic symbol table, so the program
+ * should be linked with -rdynamic.
+ *
+ * The table is copied under its lock and written without it, so dumping may
+ * allocate and is safe to do while the program runs.
+ *
+ * @param path File to write, truncated if it exists.
+ * @param format One of enum profile_format.
+ * @return 0 on success, -1 with errno set otherwise.
+ */
+int custom_profile_dump(const char *path, enum profile_format format)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  pthread_mutex_lock(&profile_lock);
+  size_t count = profile_count;
+  size_t length = MAX(count, 1) * sizeof(struct profile_sample);
+  struct profile_sample *samples = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (samples == MAP_FAILED)
+  {
+    pthread_mutex_unlock(&profile_lock);
+    close(fd);
+    errno = ENOMEM;
+    return -1;
+  }
+  for (size_t i = 0, j = 0; i < profile_capacity; i++)
+  {
+    if (profile_table[i].ptr != 0)
+    {
+      samples[j++] = profile_table[i];
+    }
+  }
+  pthread_mutex_unlock(&profile_lock);
+  size_t interval = __atomic_load_n(&profile_interval, __ATOMIC_RELAXED);
+  if (interval == 0)
+  {
+    interval = PROFILE_SAMPLE_INTERVAL;
+  }
+
+  qsort(samples, count, sizeof(struct profile_sample), compare_profile_stacks);
+  if (format == PROFILE_PPROF)
+  {
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+      total += samples[i].size;
+    }
+    dprintf(fd, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", count, total, count, total, interval);
+  }
+  for (size_t i = 0; i < count;)
+  {
+    // the samples of one stack
+    size_t objects = 0;
+    size_t bytes = 0;
+    size_t j = i;
+    for (; j < count && compare_profile_stacks(&samples[i], &samples[j]) == 0; j++)
+    {
+      objects++;
+      bytes += samples[j].size;
+    }
+    if (format == PROFILE_PPROF)
+    {
+      dprintf(fd, "%zu: %zu [%zu: %zu] @", objects, bytes, objects, bytes);
+      for (size_t k = 0; k < samples[i].depth; k++)
+      {
+        dprintf(fd, " %p", samples[i].stack[k]);
+      }
+      dprintf(fd, "\n");
+    }
+    else
+    {
+      char **symbols = backtrace_symbols(samples[i].stack, samples[i].depth);
+      for (size_t k = samples[i].depth; k-- > 0;)
+      {
+        write_frame_name(fd, symbols ? symbols[k] : NULL, samples[i].stack[k]);
+        if (k > 0)
+        {
+          dprintf(fd, ";");
+        }
+      }
+      free(symbols);
+      // an object of n bytes is sampled with probability 1 - exp(-n / interval)
+      double average = (double)bytes / objects;
+      dprintf(fd, " %.0f\n", bytes / (1 - exp(-average / interval)));
+    }
+    i = j;
+  }
+  if (format == PROFILE_PPROF)
+  {
+    dprintf(fd, "\nMAPPED_LIBRARIES:\n");
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    char buffer[4096];
+    ssize_t n;
+    while (maps >= 0 && (n = read(maps, buffer, sizeof(buffer))) > 0)
+    {
+      write(fd, buffer, n);
+    }
+    if (maps >= 0)
+    {
+      close(maps);
+    }
+  }
+  munmap(samples, length);
+  return close(fd);
+}
+
+// The public entry points below record their call when a trace runs, see custom_trace_start(), and charge it to the
+// sampling profiler, see custom_profile_start()
+
+STRATEGY_TEMPLATE void *traced_malloc(size_t size, meta_data (*find_free_block)(meta_data *prev, size_t size))
+{
+  if (!tracing())
+  {
+    return profiled(untraced_malloc(size, find_free_block), size);
+  }
+  pthread_mutex_lock(&trace_lock);
+  void *ptr = untraced_malloc(size, find_free_block);
+  if (trace_fd >= 0)
+  {
+    trace_record(TRACE_MALLOC, ptr, 0, size);
+  }
+  pthread_mutex_unlock(&trace_lock);
+  return profiled(ptr, size);
+}
+
+void custom_free(void *ptr)
+{
+  custom_free_sized(ptr, 0);
+}
+
+// Sized free, for callers that know the size they allocated "ptr" with like C++ sized delete. 0 means unknown, any
+// other size must be the one "ptr" was allocated with
+void custom_free_sized(void *ptr, size_t size)
+{
+  profile_free(ptr);
+  if (!tracing() || ptr == NULL)
+  {
+    untraced_free_sized(ptr, size);
+    return;
+  }
+  pthread_mutex_lock(&trace_lock);
+  untraced_free_sized(ptr, size);
+  if (trace_fd >= 0)
+  {
+    trace_record(TRACE_FREE, ptr, 0, size);
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+STRATEGY_TEMPLATE void *traced_realloc(void *ptr, size_t size, meta_data find_free_block(meta_data *prev, size_t size))
+{
+  // the sample of the old object is dropped, the new one is charged like a fresh allocation
+  profile_free(ptr);
+  if (!tracing())
+  {
+    return profiled(untraced_realloc(ptr, size, find_free_block), size);
+  }
+  pthread_mutex_lock(&trace_lock);
+  void *new_ptr = untraced_realloc(ptr, size, find_free_block);
+  if (trace_fd >= 0)
+  {
+    trace_record(TRACE_REALLOC, new_ptr, (uintptr_t)ptr, size);
+  }
+  pthread_mutex_unlock(&trace_lock);
+  return profiled(new_ptr, size);
+}
+
+STRATEGY_TEMPLATE void *traced_calloc(size_t nelem, size_t elsize, meta_data find_free_block(meta_data *prev, size_t size))
+{
+  if (!tracing())
+  {
+    return profiled(untraced_calloc(nelem, elsize, find_free_block), nelem * elsize);
+  }
+  pthread_mutex_lock(&trace_lock);
+  void *ptr = untraced_calloc(nelem, elsize, find_free_block);
+  if (trace_fd >= 0)
+  {
+    size_t size;
+    trace_record(TRACE_CALLOC, ptr, 0, __builtin_mul_overflow(nelem, elsize, &size) ? SIZE_MAX : size);
+  }
+  pthread_mutex_unlock(&trace_lock);
+  return profiled(ptr, nelem * elsize);
+}
+
+// The function pointer API, to pick or swap the strategy at run time
+
+void *custom_malloc(size_t size, meta_data (*find_free_block)(meta_data *prev, size_t size))
+{
+  return traced_malloc(size, find_free_block);
+}
+
+void *custom_realloc(void *ptr, size_t size, meta_data find_free_block(meta_data *prev, size_t size))
+{
+  return traced_realloc(ptr, size, find_free_block);
+}
+
+void *custom_calloc(size_t nelem, size_t elsize, meta_data find_free_block(meta_data *prev, size_t size))
+{
+  return traced_calloc(nelem, elsize, find_free_block);
+}
+
+// Instantiates the entry points of DECLARE_STRATEGY() for one strategy
+#define DEFINE_STRATEGY(strategy)                                  \
+  void *strategy##_malloc(size_t size)                             \
+  {                                                                \
+    return traced_malloc(size, strategy);                          \
+  }                                                                \
+  void *strategy##_realloc(void *ptr, size_t size)                 \
+  {                                                                \
+    return traced_realloc(ptr, size, strategy);                    \
+  }                                                                \
+  void *strategy##_calloc(size_t nelem, size_t elsize)             \
+  {                                                                \
+    return traced_calloc(nelem, elsize, strategy);                 \
+  }
+
+DEFINE_STRATEGY(best_fit)
+DEFINE_STRATEGY(next_fit)
+DEFINE_STRATEGY(first_fit)
+DEFINE_STRATEGY(segregated_fit)
+DEFINE_STRATEGY(tree_best_fit)
+
+void *custom_memalign(size_t alignment, size_t size, meta_data (*find_free_block)(meta_data *prev, size_t size))
+{
+  if (!tracing())
+  {
+    return profiled(untraced_memalign(alignment, size, find_free_block), size);
+  }
+  pthread_mutex_lock(&trace_lock);
+  void *ptr = untraced_memalign(alignment, size, find_free_block);
+  if (trace_fd >= 0)
+  {
+    trace_record(TRACE_MEMALIGN, ptr, alignment, size);
+  }
+  pthread_mutex_unlock(&trace_lock);
+  return profiled(ptr, size);
+}
+
+// Carves up to "n" blocks of "s" bytes out of one free or freshly grown block of the current arena, whose lock
+// must be held. Returns the number of blocks carved, 0 if the heap cannot hold even a single one
+size_t arena_malloc_run(size_t n, size_t s, void **out, meta_data (*find_free_block)(meta_data *prev, size_t size))
+{
+  meta_data prev = NULL;
+  size_t want = n * s;
+  meta_data mem = find_free_block(&prev, want);
+  if (mem == NULL && quick_lists_count > 0)
+  {
+    // the parked blocks may merge into a large enough block
+    consolidate_quick_lists();
+    mem = find_free_block(&prev, want);
+  }
+  if (mem != NULL)
+  {
+    bin_remove(mem);
+    set_allocated(mem);
+  }
+  else
+  {
+    size_t allocate_size = heap_growth(want);
+    if ((mem = allocate_block(allocate_size)) == NULL)
+    {
+      return 0;
+    }
+    // a free tail in front of the new memory, e.g. the top pad, joins it instead of staying behind as a hole
+    mem = merge_blocks(mem);
+    if (BLOCK_SIZE(mem) < want)
+    {
+      return 0;
+    }
+    bin_remove(mem);
+    set_allocated(mem);
+  }
+  split_block(mem, want);
+
+  // every block but the last is exactly "s" bytes, the last one keeps the slack split_block could not cut off
+  size_t total = BLOCK_SIZE(mem);
+  char *block = (char *)mem;
+  for (size_t i = 0; i < n; i++)
+  {
+    meta_data current = (meta_data)block;
+    size_t size = i == n - 1 ? total - (n - 1) * s : s;
+    current->size = size | (i == 0 ? (mem->size & PREV_FREE) : 0);
+    out[i] = WRITABLE_AREA(current);
+    block_map_set(out[i], 1);
+    block += s;
+  }
+  current_arena->live_blocks += n;
+  arena_stats.used_bytes += total;
+  return n;
+}
+
+/**
+ * @brief Allocates "n" blocks of "size" bytes at once.
+ *
+ * Slab sized requests are served from slabs under a single lock. Heap sized
+ * requests are carved in one pass out of a single free block, or out of a
+ * single extension of the heap, instead of searching and splitting once per
+ * block. The blocks are freed like any other, one by one or with
+ * custom_free_batch.
+ *
+ * @param n Number of blocks to allocate.
+ * @param size The size of every block, in bytes.
+ * @param out Receives the blocks.
+ * @param find_free_block A function pointer to find a free memory block.
+ * @return size_t The number of blocks allocated into the start of "out", less than "n" if the heap is exhausted.
+ */
+size_t custom_malloc_batch(size_t n, size_t size, void **out, meta_data (*find_free_block)(meta_data *prev, size_t size))
+{
+  if (n == 0 || size == 0 || size > SIZE_MAX / 2)
+  {
+    return 0;
+  }
+  size_t done = 0;
+  // traced and directly mapped blocks are allocated one by one
+  if (tracing() || size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED))
+  {
+    while (done < n && (out[done] = custom_malloc(size, find_free_block)) != NULL)
+    {
+      done++;
+    }
+    return done;
+  }
+
+  struct arena *arena = get_thread_arena();
+  pthread_mutex_lock(&arena->lock);
+  current_arena = arena;
+  size_t s = REQUEST_SIZE(size);
+  if (size <= __atomic_load_n(&slab_max_size, __ATOMIC_RELAXED))
+  {
+    while (done < n && (out[done] = arena_malloc(size, find_free_block)) != NULL)
+    {
+      done++;
+    }
+  }
+  else
+  {
+    // a run that does not fit is retried with half as many blocks, down to single ones
+    size_t run = MIN(n, SIZE_MAX / 2 / s);
+    while (done < n && run > 0)
+    {
+      size_t carved = arena_malloc_run(MIN(run, n - done), s, out + done, find_free_block);
+      done += carved;
+      if (carved == 0)
+      {
+        run /= 2;
+      }
+    }
+    arena_stats.class_allocations[bin_index(s)] += done;
+  }
+  pthread_mutex_unlock(&arena->lock);
+  // the arena used up its reservation, the rest comes from the main arena
+  while (done < n && arena != &arenas[0] && (out[done] = main_arena_memalign(BLOCK_ALIGN, size, find_free_block, NULL)) != NULL)
+  {
+    done++;
+  }
+  for (size_t i = 0; i < done; i++)
+  {
+    profiled(out[i], size);
+  }
+  return done;
+}
+
+// Moves ptrs[parent] down the max-heap of addresses ptrs[0 .. end)
+void sift_down_address(void **ptrs, size_t parent, size_t end)
+{
+  for (size_t child = 2 * parent + 1; child < end; child = 2 * parent + 1)
+  {
+    if (child + 1 < end && (uintptr_t)ptrs[child + 1] > (uintptr_t)ptrs[child])
+    {
+      child++;
+    }
+    if ((uintptr_t)ptrs[parent] >= (uintptr_t)ptrs[child])
+    {
+      return;
+    }
+    void *tmp = ptrs[parent];
+    ptrs[parent] = ptrs[child];
+    ptrs[child] = tmp;
+    parent = child;
+  }
+}
+
+// Sorts "ptrs" by address in place with a heapsort, which needs no memory of its own
+void sort_addresses(void **ptrs, size_t n)
+{
+  for (size_t i = n / 2; i-- > 0;)
+  {
+    sift_down_address(ptrs, i, n);
+  }
+  for (size_t end = n; end > 1;)
+  {
+    end--;
+    void *max = ptrs[0];
+    ptrs[0] = ptrs[end];
+    ptrs[end] = max;
+    sift_down_address(ptrs, 0, end);
+  }
+}
+
+// Returns whether "ptr" is an allocated heap block of the current arena, whose lock must be held
+static inline int is_allocated_heap_block(void *ptr)
+{
+  return is_valid_addr(ptr) && !(HEADER_AREA(ptr)->size & (BLOCK_FREE | BLOCK_QUICK | BLOCK_MMAPPED));
+}
+
+// Locks "arena" and makes it the current one, unless it already is the "locked" one. Returns the arena now locked
+static inline struct arena *switch_arena_lock(struct arena *locked, struct arena *arena)
+{
+  if (arena != locked)
+  {
+    if (locked)
+    {
+      pthread_mutex_unlock(&locked->lock);
+    }
+    pthread_mutex_lock(&arena->lock);
+    current_arena = arena;
+  }
+  return arena;
+}
+
+/**
+ * @brief Frees "n" blocks at once.
+ *
+ * Slab objects and mapped blocks are freed first, the arena lock is only
+ * taken again when the sweep reaches another arena. The heap blocks left are
+ * sorted by address and freed in a second sweep: each run of blocks that are
+ * neighbours in the heap becomes a single block that is merged with the blocks
+ * around it once. The end of the heap can only be freed by the last run of an
+ * arena, so the heap is trimmed once.
+ *
+ * @param n Number of blocks.
+ * @param ptrs The blocks, NULL entries are skipped. The array is used as scratch space and its content is lost.
+ */
+void custom_free_batch(size_t n, void **ptrs)
+{
+  if (tracing())
+  {
+    for (size_t i = 0; i < n; i++)
+    {
+      custom_free(ptrs[i]);
+    }
+    return;
+  }
+
+  struct arena *locked = NULL;
+  size_t heap_blocks = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    void *ptr = ptrs[i];
+    profile_free(ptr);
+    if (ptr == NULL)
+    {
+      continue;
+    }
+    if (is_slab_addr(ptr))
+    {
+      locked = switch_arena_lock(locked, arena_for_address(ptr));
+      slab_free(ptr);
+    }
+    else if (!__atomic_load_n(&trusted_free, __ATOMIC_RELAXED) && !block_map_test(ptr))
+    {
+      continue;
+    }
+    else if (__atomic_load_n(&HEADER_AREA(ptr)->size, __ATOMIC_RELAXED) & BLOCK_MMAPPED)
+    {
+      munmap_block(ptr);
+    }
+    else
+    {
+      ptrs[heap_blocks++] = ptr;
+    }
+  }
+
+  sort_addresses(ptrs, heap_blocks);
+  for (size_t i = 0; i < heap_blocks; i++)
+  {
+    void *ptr = ptrs[i];
+    if (i > 0 && ptr == ptrs[i - 1])
+    {
+      continue;
+    }
+    locked = switch_arena_lock(locked, arena_for_address(ptr));
+    // parked blocks have to keep their own size
+    if (__atomic_load_n(&deferred_coalescing, __ATOMIC_RELAXED) || !is_allocated_heap_block(ptr))
+    {
+      arena_free(ptr);
+      continue;
+    }
+
+    // gathers the following blocks that are the direct neighbours of the run into it
+    meta_data block = HEADER_AREA(ptr);
+    size_t size = BLOCK_SIZE(block);
+    size_t count = 1;
+    while (i + 1 < heap_blocks && ptrs[i + 1] == WRITABLE_AREA((meta_data)((char *)block + size)) &&
+           is_allocated_heap_block(ptrs[i + 1]))
+    {
+      block_map_set(ptrs[++i], 0);
+      size += BLOCK_SIZE(HEADER_AREA(ptrs[i]));
+      count++;
+    }
+    if (count > 1)
+    {
+      block->size = size | (block->size & PREV_FREE);
+      current_arena->live_blocks -= count - 1;
+      // next fit must not resume from a header that is now inside the run
+      if ((char *)last_allocated > (char *)block && (char *)last_allocated < (char *)block + size)
+      {
+        last_allocated = block;
+      }
+    }
+    arena_free(ptr);
+  }
+  if (locked)
+  {
+    pthread_mutex_unlock(&locked->lock);
+  }
 }
@@ -1,59 +1,589 @@
 #ifndef CUSTOM_ALLOC_H
 #define CUSTOM_ALLOC_H
+#ifndef CUSTOM_ALLOC_RELEASE
+#define CUSTOM_ALLOC_RELEASE 0 // build with -DCUSTOM_ALLOC_RELEASE=1 to drop the heap checks and hardening
+#endif
+#if CUSTOM_ALLOC_RELEASE && !defined(NDEBUG)
+#define NDEBUG // turns the heap consistency asserts off, must come before <assert.h>
+#endif
 #include <unistd.h>
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <errno.h>
 
 
-#define PAGE_SIZE 4096
-#define MEM_ALLOC_SIZE (1* PAGE_SIZE)
-#define MEM_DEALLOC_SIZE (2 *PAGE_SIZE) // TODO: why??--> Maybe to reduce fragmentation by freeing large chunks?
+#define PAGE_SIZE 4096 // unit of slabs and heap growth, the pages of the OS may be larger, see os_page_size()
+#define HUGE_PAGE_SIZE ((size_t)2 << 20) // transparent huge page, see custom_set_huge_pages()
+#define MEM_ALLOC_SIZE (1* PAGE_SIZE) // default first growth of a heap, see heap_growth()
+#define MAX_GROWTH_STEP (1024 * 1024) // the growth of a heap doubles up to this size
+// default free tail of a heap, beyond the top pad, that makes the heap shrink. Giving back less only
+// invites the next allocation to grow the heap again, with a system call each way
+#define MEM_DEALLOC_SIZE (128 * 1024)
+#define TOP_PAD (64 * 1024) // default free memory kept at the end of a heap when it grows or shrinks
+#define MMAP_THRESHOLD (128 * 1024) // default size from which blocks are mapped directly instead of taken from the heap
+#define RECLAIM_THRESHOLD (256 * 1024) // default size from which free blocks give their interior pages back to the OS
 typedef struct meta_data *meta_data;
 
 
 
 
 /**
- * struct meta_data - Structure to hold metadata for custom memory allocator.
- * @free: Indicates if the block is free (1) or allocated (0).
- * @size: Size of the memory block.
- * @next: Pointer to the next metadata block in the linked list.
- * @prev: Pointer to the previous metadata block in the linked list.
- * @ptr: Pointer to the actual memory block.
+ * struct meta_data - Header in front of every block of the custom memory allocator.
+ * @size: Size of the whole block including this header. Blocks are BLOCK_ALIGN
+ *        aligned, so the low bits of the size are free to hold the block flags.
+ *
+ * The blocks of a heap segment follow each other without gaps, so the next
+ * block is found by adding the size. Only a free block repeats its size in a
+ * footer (its last word); the PREV_FREE flag of the following block says that
+ * the footer is there, which is all merge_blocks needs to find a free
+ * predecessor. Every segment ends in a fence, a header of size zero followed
+ * by a link to the first block of the next segment of the arena.
  */
 struct meta_data
 {   
-    unsigned char free;     // 1-bit for free status         
-    //void* ptr;          // Pointer to the memory block
-    size_t size; // Block size
-    meta_data next;    // Next block
-    meta_data prev;    // Previous block (optional)
-    
+    size_t size; // Block size | flags
 };
 
+#define BLOCK_ALIGN 16
+#define BLOCK_ALIGN_SHIFT 4 // log2(BLOCK_ALIGN)
+#define BLOCK_FREE 1    // the block is free
+#define PREV_FREE 2     // the block in front is free and ends in a footer
+#define BLOCK_MMAPPED 4 // the block was mapped on its own with mmap instead of being part of a heap
+#define BLOCK_QUICK 8   // the block was freed into a quick list and still counts as allocated until it is coalesced
+#define BLOCK_FLAGS (BLOCK_ALIGN - 1)
 
 #define META_DATA_SIZE sizeof(struct meta_data)
+#define MIN_BLOCK_SIZE (4 * META_DATA_SIZE)             // header, free links and footer
+#define FENCE_SIZE (2 * META_DATA_SIZE)                 // header of size zero and the link to the next segment
+#define SEGMENT_OVERHEAD (META_DATA_SIZE + FENCE_SIZE)  // alignment word in front of the first block and the fence
 #define WRITABLE_AREA(p) (((meta_data )p) + 1)
 #define HEADER_AREA(p) (((meta_data )p) - 1)
 #define MAX(X, Y) (((size_t)(X) > (size_t)(Y)) ? (size_t)(X) : (size_t)(Y))
+#define MIN(X, Y) (((size_t)(X) < (size_t)(Y)) ? (size_t)(X) : (size_t)(Y))
 #define ALLING(x, a) (((x) + (a - 1)) & ~(a - 1))
+#define BLOCK_SIZE(p) ((p)->size & ~(size_t)BLOCK_FLAGS)
+#define USABLE_SIZE(p) (BLOCK_SIZE(p) - META_DATA_SIZE)
+#define IS_FREE(p) ((p)->size & BLOCK_FREE)
+#define IS_FENCE(p) (BLOCK_SIZE(p) == 0)
+#define NEXT_BLOCK(p) ((meta_data)((char *)(p) + BLOCK_SIZE(p)))
+#define FOOTER(p) (((size_t *)NEXT_BLOCK(p))[-1])
+#define PREV_BLOCK(p) ((meta_data)((char *)(p) - ((size_t *)(p))[-1])) // only valid if PREV_FREE is set
+#define FENCE_NEXT(p) (*(meta_data *)((p) + 1))
+#define REQUEST_SIZE(x) MAX(ALLING((x) + META_DATA_SIZE, BLOCK_ALIGN), MIN_BLOCK_SIZE) // block size holding x bytes
 
-meta_data heap_list_start = NULL;
-meta_data last_allocated = NULL;
-meta_data heap_list_end = NULL;
+/**
+ * struct free_links - Links of a free block inside its size-class bin.
+ * @next_free: Next free block in the same bin.
+ * @prev_free: Previous free block in the same bin.
+ *
+ * Only free blocks are kept in a bin, so the links live in the (unused)
+ * writable area of the block instead of growing struct meta_data.
+ */
+struct free_links
+{
+    meta_data next_free;
+    meta_data prev_free;
+};
+
+#define FREE_LINKS(p) ((struct free_links *)WRITABLE_AREA(p))
+
+/**
+ * struct tree_links - Children of a free block in the size-ordered tree of its arena.
+ * @left: Subtree of the blocks ordered before the block.
+ * @right: Subtree of the blocks ordered after the block.
+ *
+ * Free blocks larger than SMALL_BIN_MAX are also kept in a treap ordered by
+ * size and then address, whose priorities are a hash of the block address.
+ * The links follow the bin links in the writable area.
+ */
+struct tree_links
+{
+    meta_data left;
+    meta_data right;
+};
+
+#define TREE_LINKS(p) ((struct tree_links *)(FREE_LINKS(p) + 1))
+// bytes of a free block beyond the small bins given back to the OS, reset whenever the block enters a bin
+#define RECLAIMED(p) (*(size_t *)(TREE_LINKS(p) + 1))
+
+// size classes: exact bins of SIZE_CLASS_STEP bytes up to SMALL_BIN_MAX, then one bin per power of two
+#define SIZE_CLASS_STEP BLOCK_ALIGN
+#define SMALL_BIN_MAX 512
+#define SMALL_BIN_SHIFT 9 // log2(SMALL_BIN_MAX)
+#define SMALL_BIN_COUNT (SMALL_BIN_MAX / SIZE_CLASS_STEP)
+#define BIN_COUNT 64
+
+#define ARENA_COUNT 8                             // independent heaps, threads are spread over them round-robin
+#define ARENA_RESERVE_SIZE ((size_t)1 << 30)      // address space reserved for each secondary arena
+
+// deferred coalescing: freed blocks up to QUICK_MAX_SIZE are parked in one quick list per exact size
+#define QUICK_MAX_SIZE 1024
+#define QUICK_COUNT (QUICK_MAX_SIZE / BLOCK_ALIGN + 1)
+#define QUICK_THRESHOLD 512 // parked blocks of an arena that trigger a coalescing pass
+#define QUICK_CONSOLIDATE_SIZE (64 * 1024) // freed blocks from this size coalesce the parked ones before the heap is trimmed
+#define QUICK_NEXT(p) (FREE_LINKS(p)->next_free)
+
+#define SLAB_SIZE PAGE_SIZE
+#define SLAB_MAX_SIZE 256 // largest request served from slabs
+#define SLAB_CLASS_COUNT (SLAB_MAX_SIZE / SIZE_CLASS_STEP)
+#define SLAB_CACHE_MAX 32 // empty slabs an arena keeps for reuse before giving them back to its heap
+
+// thread caches: freed objects up to TCACHE_MAX_SIZE stay with their thread, one list per size class
+#define TCACHE_MAX_SIZE QUICK_MAX_SIZE
+#define TCACHE_CLASS_COUNT (TCACHE_MAX_SIZE / SIZE_CLASS_STEP + 1)
+#define TCACHE_BIN_MAX 16          // objects a thread keeps per size class, half of them go back once it is full
+#define REMOTE_FREE_BATCH 32       // objects of another arena a thread gathers before handing them over at once
+#define REMOTE_DRAIN_LIMIT 4096    // objects waiting for an arena after which the freeing thread drains them itself
+
+struct slab;
+
+// fit strategies, counted separately in the statistics
+enum fit_strategy
+{
+    FIT_BEST,
+    FIT_NEXT,
+    FIT_FIRST,
+    FIT_SEGREGATED,
+    FIT_TREE,
+    FIT_COUNT
+};
+
+/**
+ * struct arena_stats - Counters an arena updates as it runs, see custom_alloc_stats().
+ * @heap_bytes: Memory obtained from the OS for the heap.
+ * @used_bytes: Allocated blocks of the heap, headers and the blocks holding slabs included.
+ * @free_bytes: Free blocks in the bins.
+ * @free_blocks: Number of free blocks in the bins.
+ * @quick_bytes: Blocks parked in the quick lists.
+ * @slab_bytes: Blocks holding slabs.
+ * @slab_objects: Objects allocated from slabs.
+ * @slab_object_bytes: Slots of the objects allocated from slabs.
+ * @sbrk_calls: Calls growing the heap, sbrk or mprotect for secondary arenas.
+ * @brk_calls: Calls shrinking the heap, brk or madvise and mprotect for secondary arenas.
+ * @searches: Fit searches per strategy.
+ * @search_steps: Blocks looked at by the fit searches per strategy.
+ * @class_allocations: Allocations per size class, by the bin of the block size.
+ */
+struct arena_stats
+{
+    size_t heap_bytes;
+    size_t used_bytes;
+    size_t free_bytes;
+    size_t free_blocks;
+    size_t quick_bytes;
+    size_t slab_bytes;
+    size_t slab_objects;
+    size_t slab_object_bytes;
+    size_t sbrk_calls;
+    size_t brk_calls;
+    size_t searches[FIT_COUNT];
+    size_t search_steps[FIT_COUNT];
+    size_t class_allocations[BIN_COUNT];
+};
+
+/**
+ * struct arena - An independent heap with its own block list and lock.
+ * @lock: Serializes every operation on the arena.
+ * @list_start: First block of the arena (heap_list_start).
+ * @list_fence: Fence closing the last segment of the arena (heap_list_fence).
+ * @list_cursor: Block the next fit search resumes from (last_allocated).
+ * @bins: Free blocks per size class (free_bins).
+ * @bins_bitmap: Bit i is set when bins[i] is non-empty (free_bins_bitmap).
+ * @tree_root: Root of the size-ordered tree of the free blocks beyond the small bins (free_tree_root).
+ * @quick: Blocks freed in deferred coalescing mode per exact size, linked through QUICK_NEXT (quick_lists).
+ * @quick_count: Number of blocks in the quick lists (quick_lists_count).
+ * @base: Start of the reserved address range, NULL for the main arena which grows with sbrk.
+ * @top: Current break of the arena, i.e. the end of its last fence.
+ * @committed: End of the read/write part of the reserved range.
+ * @limit: End of the reserved address range.
+ * @brk_floor: Lowest address the main arena took with sbrk, the program break is never moved below it.
+ * @slabs: Slabs with at least one free slot per slab class.
+ * @empty_slabs: Empty slabs kept for reuse by any slab class, linked through their next field.
+ * @empty_slab_count: Number of slabs in empty_slabs.
+ * @live_blocks: Allocated blocks of the heap, the slabs included.
+ * @slab_pages: Slabs taken from the heap.
+ * @busy_slabs: Slabs holding at least one object.
+ * @reclaimed: Bytes inside the free blocks of the heap given back to the OS with madvise.
+ * @stats: Counters of the arena (arena_stats).
+ *
+ * Arena 0 is the classic sbrk heap, with segments mapped with mmap when the
+ * program break cannot move. The other arenas carve their heap out of one
+ * PROT_NONE reservation, so the owner of any pointer follows from its address.
+ */
+struct arena
+{
+    pthread_mutex_t lock;
+    meta_data list_start;
+    meta_data list_fence;
+    meta_data list_cursor;
+    meta_data bins[BIN_COUNT];
+    uint64_t bins_bitmap;
+    meta_data tree_root;
+    meta_data quick[QUICK_COUNT];
+    size_t quick_count;
+    char *base;
+    char *top;
+    char *committed;
+    char *limit;
+    char *brk_floor;
+    char *fresh; // where the zero filled memory of the last heap growth starts, see allocate_block()
+    size_t growth; // size of the next heap growth before padding, 0 until the first one, see heap_growth()
+    struct slab *slabs[SLAB_CLASS_COUNT];
+    struct slab *empty_slabs;
+    size_t empty_slab_count;
+    size_t live_blocks;
+    size_t slab_pages;
+    size_t busy_slabs;
+    size_t reclaimed;
+    void *remote_frees;  // objects other threads freed, linked through their first word, see remote_push()
+    size_t remote_count; // approximate length of "remote_frees"
+    struct arena_stats stats;
+};
+
+// thread-local storage that never goes through __tls_get_addr, which may itself allocate when built as a preloaded library
+#define ALLOC_TLS __thread __attribute__((tls_model("initial-exec")))
+
+struct arena arenas[ARENA_COUNT] = {[0 ... ARENA_COUNT - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}};
+
+// arena the calling thread is operating on, only valid while its lock is held
+ALLOC_TLS struct arena *current_arena = &arenas[0];
+
+/**
+ * struct remote_batch - Objects of another arena a thread freed and has not handed over yet.
+ * @head: First object, the objects are linked through their first word.
+ * @tail: Last object.
+ * @count: Number of objects.
+ */
+struct remote_batch
+{
+    void *head;
+    void *tail;
+    size_t count;
+};
+
+/**
+ * struct thread_cache - Objects a thread freed, which it allocates again without taking a lock.
+ * @bins: Cached objects per size class, by usable size / SIZE_CLASS_STEP. Linked through their
+ *        first word, their second word points to the cache to catch double frees, as it does
+ *        for the objects in @remote.
+ * @counts: Number of objects in each bin.
+ * @remote: Objects freed to each other arena, handed over in batches.
+ * @state: 0 until the first free, 1 once the cache is set to be flushed at thread exit, -1 after the flush.
+ */
+struct thread_cache
+{
+    void *bins[TCACHE_CLASS_COUNT];
+    uint16_t counts[TCACHE_CLASS_COUNT];
+    struct remote_batch remote[ARENA_COUNT];
+    int state;
+};
+
+ALLOC_TLS struct thread_cache thread_cache;
+
+int thread_cache_enabled = 1; // see custom_set_thread_cache()
+
+// the allocator code below works on the state of the current arena
+#define heap_list_start (current_arena->list_start)
+#define heap_list_fence (current_arena->list_fence)
+#define last_allocated (current_arena->list_cursor)
+#define free_bins (current_arena->bins)
+#define free_bins_bitmap (current_arena->bins_bitmap)
+#define free_tree_root (current_arena->tree_root)
+#define quick_lists (current_arena->quick)
+#define quick_lists_count (current_arena->quick_count)
+#define arena_stats (current_arena->stats)
+
+int deferred_coalescing = 0;            // see custom_set_deferred_coalescing()
+#ifndef CUSTOM_ALLOC_TRUSTED
+#define CUSTOM_ALLOC_TRUSTED CUSTOM_ALLOC_RELEASE // build with -DCUSTOM_ALLOC_TRUSTED=1 to skip the validation of freed pointers by default
+#endif
+int trusted_free = CUSTOM_ALLOC_TRUSTED; // see custom_set_trusted_free()
+size_t mmap_threshold = MMAP_THRESHOLD; // requests of at least this size bypass the heap, see custom_set_mmap_threshold()
+size_t reclaim_threshold = RECLAIM_THRESHOLD; // see custom_set_reclaim_threshold()
+size_t growth_step = MEM_ALLOC_SIZE;    // see custom_mallopt()
+size_t trim_threshold = MEM_DEALLOC_SIZE; // see custom_mallopt()
+size_t top_pad = TOP_PAD;               // see custom_mallopt()
+int huge_pages = 0;                     // see custom_set_huge_pages()
+size_t system_page_size = 0;            // page size of the OS once queried, see os_page_size()
+
+/**
+ * struct slab - A page of equally sized small objects, taken from the heap of an arena as one block.
+ * @next: Next slab of the same class with a free slot.
+ * @prev: Previous slab of the same class with a free slot.
+ * @free_list: Freed slots, linked through their first word.
+ * @arena: Arena whose heap holds the slab.
+ * @object_size: Size of every slot.
+ * @size_class: Index of the slab in the slabs of its arena.
+ * @capacity: Number of slots of the slab.
+ * @used: Number of allocated slots.
+ * @carved: Number of slots handed out at least once, the slots behind them were never touched.
+ *
+ * The slab header sits at the start of the page, so the slab of an object
+ * follows from its address and the objects carry no header of their own.
+ */
+struct slab
+{
+    struct slab *next;
+    struct slab *prev;
+    void *free_list;
+    struct arena *arena;
+    uint32_t object_size;
+    uint32_t size_class;
+    uint32_t capacity;
+    uint32_t used;
+    uint32_t carved;
+};
+
+#define SLAB_HEADER_SIZE ALLING(sizeof(struct slab), BLOCK_ALIGN)
+#define SLAB_OF(p) ((struct slab *)((uintptr_t)(p) & ~(uintptr_t)(SLAB_SIZE - 1)))
+
+// one bit per page of the address space telling whether the page is a slab, in leaves of PAGE_MAP_LEAF_BITS pages
+#define PAGE_SHIFT 12 // log2(PAGE_SIZE)
+#define ADDRESS_BITS 48
+#define PAGE_MAP_LEAF_BITS 20
+#define PAGE_MAP_ROOT_SIZE ((size_t)1 << (ADDRESS_BITS - PAGE_SHIFT - PAGE_MAP_LEAF_BITS))
+#define PAGE_MAP_LEAF_SIZE (((size_t)1 << PAGE_MAP_LEAF_BITS) / 8)
+
+uint64_t *slab_page_map[PAGE_MAP_ROOT_SIZE];
+
+// one bit per BLOCK_ALIGN bytes of the address space, set at the writable area of every heap or mapped block handed
+// out, in leaves of BLOCK_MAP_LEAF_BITS bits. Together with the slab page map it tells in O(1) whether the allocator
+// owns a pointer, without touching the memory around it
+#define BLOCK_MAP_LEAF_BITS 26 // a leaf covers 1 GiB of address space in 8 MiB, only the touched pages are resident
+#define BLOCK_MAP_ROOT_SIZE ((size_t)1 << (ADDRESS_BITS - BLOCK_ALIGN_SHIFT - BLOCK_MAP_LEAF_BITS))
+#define BLOCK_MAP_LEAF_SIZE (((size_t)1 << BLOCK_MAP_LEAF_BITS) / 8)
+
+uint64_t *block_map[BLOCK_MAP_ROOT_SIZE];
+
+#define HEAP_SEGMENT_SIZE (256 * 1024) // smallest segment the main arena maps when the program break cannot move
+size_t slab_max_size = SLAB_MAX_SIZE; // requests up to this size are served from slabs, see custom_set_slab_max_size()
+
+/**
+ * struct mmap_chunk - Bookkeeping in front of the header of a block mapped directly with mmap.
+ * @next: Next mapped block.
+ * @prev: Previous mapped block.
+ * @length: Length of the whole mapping.
+ */
+struct mmap_chunk
+{
+    struct mmap_chunk *next;
+    struct mmap_chunk *prev;
+    size_t length;
+};
 
+#define MMAP_HEADER_OFFSET sizeof(struct mmap_chunk)
+#define MMAP_CHUNK(p) ((struct mmap_chunk *)((char *)(p) - MMAP_HEADER_OFFSET))
+
+pthread_mutex_t mmap_lock = PTHREAD_MUTEX_INITIALIZER;
+struct mmap_chunk *mmap_list = NULL; // blocks mapped directly with mmap
+size_t mmap_bytes = 0;               // length of the mappings in mmap_list, guarded by mmap_lock
+size_t mmap_blocks = 0;              // number of mappings in mmap_list, guarded by mmap_lock
+
+/**
+ * struct custom_alloc_stats - Snapshot of the allocator, see custom_alloc_stats().
+ * @heap_bytes: Memory obtained from the OS for the heaps of all arenas.
+ * @in_use_bytes: Memory handed to the program: heap blocks with their header, slab slots and mapped blocks.
+ * @free_bytes: Free heap memory: free blocks, parked blocks and the free slots of slabs.
+ * @mapped_bytes: Blocks mapped directly with mmap.
+ * @reclaimed_bytes: Part of free_bytes given back to the OS with madvise.
+ * @allocated_blocks: Allocated heap blocks, slab objects and mapped blocks.
+ * @free_blocks: Free heap blocks.
+ * @mapped_blocks: Blocks mapped directly with mmap.
+ * @slab_objects: Objects allocated from slabs.
+ * @largest_free_block: Size of the largest free heap block.
+ * @fragmentation: External fragmentation, 1 - largest_free_block / size of all free heap blocks.
+ * @sbrk_calls: Calls growing a heap.
+ * @brk_calls: Calls shrinking a heap.
+ * @searches: Fit searches per strategy, indexed by enum fit_strategy.
+ * @average_search_length: Blocks looked at per fit search per strategy.
+ * @class_allocations: Allocations per size class, by bin_index() of the block size.
+ */
+struct custom_alloc_stats
+{
+    size_t heap_bytes;
+    size_t in_use_bytes;
+    size_t free_bytes;
+    size_t mapped_bytes;
+    size_t reclaimed_bytes;
+    size_t allocated_blocks;
+    size_t free_blocks;
+    size_t mapped_blocks;
+    size_t slab_objects;
+    size_t largest_free_block;
+    double fragmentation;
+    size_t sbrk_calls;
+    size_t brk_calls;
+    size_t searches[FIT_COUNT];
+    double average_search_length[FIT_COUNT];
+    size_t class_allocations[BIN_COUNT];
+};
+
+// Parameters of custom_mallopt(), the tunable ones share their number with the mallopt() of glibc
+enum custom_mallopt_param
+{
+    CUSTOM_M_TRIM_THRESHOLD = -1, // free tail beyond the top pad that makes a heap shrink
+    CUSTOM_M_TOP_PAD = -2,        // free memory kept at the end of a heap when it grows or shrinks
+    CUSTOM_M_MMAP_THRESHOLD = -3, // requests of at least this size are mapped on their own
+    CUSTOM_M_GROWTH_STEP = -100,  // first growth of a heap, later ones double up to MAX_GROWTH_STEP
+};
+
+#define REGION_CHUNK_SIZE (64 * 1024) // default chunk size of a region, below the mmap threshold so chunks come from the heap
+
+/**
+ * struct region_chunk - A heap block a region bumps its allocations through.
+ * @next: Next chunk of the region, chunks are kept across resets.
+ * @size: Bytes after the chunk header.
+ */
+struct region_chunk
+{
+    struct region_chunk *next;
+    size_t size;
+};
+
+#define REGION_CHUNK_HEADER_SIZE ALLING(sizeof(struct region_chunk), BLOCK_ALIGN)
+#define REGION_CHUNK_START(c) ((char *)(c) + REGION_CHUNK_HEADER_SIZE)
+
+/**
+ * struct custom_arena - A region whose objects are freed all at once, see custom_arena_create().
+ * @first: Chunk holding this structure, the first one to bump through.
+ * @current: Chunk allocations are bumped from.
+ * @cursor: Next free byte of the current chunk.
+ * @end: End of the current chunk.
+ * @chunk_size: Size of the chunks taken from the heap.
+ * @find_free_block: Fit strategy used to take chunks from the heap.
+ *
+ * Not to be confused with struct arena, the heap of a group of threads: a
+ * region lives inside these heaps and is not thread safe.
+ */
+struct custom_arena
+{
+    struct region_chunk *first;
+    struct region_chunk *current;
+    char *cursor;
+    char *end;
+    size_t chunk_size;
+    meta_data (*find_free_block)(meta_data *prev, size_t size);
+};
+
+#define TRACE_MAGIC "CATRACE1"      // first bytes of a trace file
+#define TRACE_BUFFER_SIZE (64 * 1024) // bytes of records gathered before they are written out
+
+enum trace_op {TRACE_MALLOC, TRACE_FREE, TRACE_REALLOC, TRACE_CALLOC, TRACE_MEMALIGN};
+
+/**
+ * struct trace_record - One operation of a trace, see custom_trace_start().
+ * @time: Nanoseconds since the trace was started.
+ * @ptr: Address returned by the operation, or freed by TRACE_FREE. 0 when an allocation failed.
+ * @old_ptr: Address passed to TRACE_REALLOC, alignment of TRACE_MEMALIGN, 0 otherwise.
+ * @size: Requested size, the total size for TRACE_CALLOC, the size passed to custom_free_sized or 0 for TRACE_FREE.
+ * @op: The enum trace_op of the operation.
+ *
+ * Addresses only serve as identifiers: no two live objects share one, so a
+ * replay maps each of them to the object it allocated in its place.
+ */
+struct trace_record
+{
+    uint64_t time;
+    uint64_t ptr;
+    uint64_t old_ptr;
+    uint64_t size;
+    uint8_t op;
+} __attribute__((packed));
+
+int trace_fd = -1;            // file the trace goes to, -1 while not tracing
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER; // serializes traced operations and guards the buffer
+unsigned char trace_buffer[TRACE_BUFFER_SIZE];
+size_t trace_buffer_used = 0;
+uint64_t trace_start_time = 0;
+
+#define PROFILE_SAMPLE_INTERVAL (512 * 1024) // default mean number of bytes allocated between two samples
+#define PROFILE_MAX_DEPTH 32                 // frames recorded per sampled allocation
+#define PROFILE_IDLE_COUNTDOWN (1024 * 1024) // bytes a thread allocates between two looks at whether profiling started
+#define PROFILE_TABLE_MIN_SIZE 1024          // first capacity of the table of sampled allocations
+
+// output formats of custom_profile_dump()
+enum profile_format {PROFILE_PPROF, PROFILE_COLLAPSED};
+
+/**
+ * struct profile_sample - A live sampled allocation, see custom_profile_start().
+ * @ptr: Address of the allocation, 0 for an empty slot of the table.
+ * @size: Requested size.
+ * @depth: Number of frames in @stack.
+ * @stack: Return addresses of the call, innermost first.
+ */
+struct profile_sample
+{
+    uint64_t ptr;
+    uint64_t size;
+    uint64_t depth;
+    void *stack[PROFILE_MAX_DEPTH];
+};
+
+size_t profile_interval = 0; // mean bytes between two samples, 0 while not profiling
+pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER; // guards the table of sampled allocations
+struct profile_sample *profile_table = NULL; // live sampled allocations by address, open addressing, NULL until the first sample
+size_t profile_capacity = 0; // slots of profile_table, a power of two
+size_t profile_count = 0;    // live sampled allocations in profile_table
+// one bit per BLOCK_ALIGN bytes of the address space, set at the sampled allocations, so that a free looks them up
+// in the table only when they are there
+uint64_t *profile_map[BLOCK_MAP_ROOT_SIZE];
+ALLOC_TLS intptr_t profile_countdown = 0; // bytes the thread allocates before its next sample
+ALLOC_TLS uint64_t profile_random = 0;    // xorshift state drawing the sample intervals of the thread
 
 int brk(void *addr);
 void *sbrk(intptr_t increment);
 
 void *custom_malloc(size_t size, meta_data find_free_block(meta_data* prev,size_t size));
 void custom_free(void *ptr);
+void custom_free_sized(void *ptr, size_t size);
 void *custom_realloc(void *ptr, size_t size, meta_data find_free_block(meta_data* prev,size_t size));
 void *custom_calloc(size_t nelem, size_t elsize, meta_data find_free_block(meta_data* prev,size_t size));
+void *custom_memalign(size_t alignment, size_t size, meta_data find_free_block(meta_data* prev,size_t size));
+void *custom_aligned_alloc(size_t alignment, size_t size, meta_data find_free_block(meta_data* prev,size_t size));
+int custom_posix_memalign(void **memptr, size_t alignment, size_t size, meta_data find_free_block(meta_data* prev,size_t size));
 
 int is_valid_addr(void *p);
+size_t custom_usable_size(void *ptr);
+void custom_set_mmap_threshold(size_t threshold);
+void custom_set_slab_max_size(size_t size);
+void custom_set_deferred_coalescing(int enabled);
+void custom_set_trusted_free(int enabled);
+void custom_set_reclaim_threshold(size_t threshold);
+size_t custom_reclaim(void);
+void custom_set_thread_cache(int enabled);
+void custom_set_huge_pages(int enabled);
+int custom_mallopt(int param, int value);
+void custom_mallopt_from_env(void);
+void custom_thread_cache_flush(void);
+void custom_alloc_stats(struct custom_alloc_stats *stats);
+struct custom_arena *custom_arena_create(size_t chunk_size, meta_data find_free_block(meta_data* prev,size_t size));
+void *custom_arena_alloc(struct custom_arena *arena, size_t size);
+void custom_arena_reset(struct custom_arena *arena);
+void custom_arena_destroy(struct custom_arena *arena);
+size_t custom_malloc_batch(size_t n, size_t size, void **out, meta_data find_free_block(meta_data* prev,size_t size));
+void custom_free_batch(size_t n, void **ptrs);
+int custom_trace_start(const char *path);
+void custom_trace_stop(void);
+void custom_profile_start(size_t interval);
+int custom_profile_dump(const char *path, enum profile_format format);
+
+// A strategy and the entry points specialized for it, which search the heap with a direct call instead of going
+// through a function pointer, e.g. segregated_fit_malloc(size) for custom_malloc(size, segregated_fit)
+#define DECLARE_STRATEGY(strategy)                      \
+    meta_data strategy(meta_data *prev, size_t size);   \
+    void *strategy##_malloc(size_t size);               \
+    void *strategy##_realloc(void *ptr, size_t size);   \
+    void *strategy##_calloc(size_t nelem, size_t elsize);
+
+DECLARE_STRATEGY(best_fit)
+DECLARE_STRATEGY(next_fit)
+DECLARE_STRATEGY(first_fit)
+DECLARE_STRATEGY(segregated_fit)
+DECLARE_STRATEGY(tree_best_fit)
 
 
 
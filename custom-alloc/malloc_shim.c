@@ -0,0 +1,253 @@
+/*
+ * Drop-in replacement of the libc allocator on top of custom_alloc.
+ *
+ * Build the shared library with
+ *   gcc -O2 -shared -fPIC -fvisibility=hidden -o libcustom_alloc.so custom-alloc/malloc_shim.c -lpthread
+ * adding -DCUSTOM_ALLOC_RELEASE=1 for a release build without heap checks
+ * and pointer validation,
+ * and run any binary unmodified with
+ *   LD_PRELOAD=./libcustom_alloc.so CUSTOM_ALLOC_STRATEGY=best_fit ./program
+ *
+ * CUSTOM_ALLOC_STRATEGY selects the fit strategy: best_fit, first_fit,
+ * next_fit, tree_best_fit or segregated_fit (the default).
+ * CUSTOM_ALLOC_TRUSTED=1 skips the validation of freed pointers, see
+ * custom_set_trusted_free().
+ * CUSTOM_ALLOC_HUGE_PAGES=1 backs the heaps with transparent huge pages, see
+ * custom_set_huge_pages().
+ * CUSTOM_ALLOC_GROWTH_STEP, CUSTOM_ALLOC_TRIM_THRESHOLD, CUSTOM_ALLOC_TOP_PAD
+ * and CUSTOM_ALLOC_MMAP_THRESHOLD tune the heap growth and trimming, see
+ * custom_mallopt(); mallopt() takes the same parameters at run time.
+ * CUSTOM_ALLOC_PROFILE names a file to write a heap profile of the live
+ * allocations to at exit, sampled every CUSTOM_ALLOC_PROFILE_INTERVAL bytes on
+ * average (PROFILE_SAMPLE_INTERVAL by default), in pprof format or in the
+ * collapsed stack format with CUSTOM_ALLOC_PROFILE_FORMAT=collapsed, see
+ * custom_profile_start() and custom_profile_dump().
+ * CUSTOM_ALLOC_TRACE names a file to record a trace of the program into, see
+ * custom_trace_start() and replay_custom_malloc.c.
+ */
+#include "custom_alloc.c"
+#include <errno.h>
+#include <stdlib.h>
+
+#define SHIM_EXPORT __attribute__((visibility("default")))
+
+meta_data (*shim_strategy)(meta_data *prev, size_t size) = NULL;
+
+// Picks the fit strategy from CUSTOM_ALLOC_STRATEGY on first use; getenv does not allocate
+meta_data (*get_shim_strategy(void))(meta_data *prev, size_t size)
+{
+  if (shim_strategy == NULL)
+  {
+    meta_data (*strategy)(meta_data *prev, size_t size) = segregated_fit;
+    const char *name = getenv("CUSTOM_ALLOC_STRATEGY");
+    if (name)
+    {
+      if (strcmp(name, "best_fit") == 0)
+        strategy = best_fit;
+      else if (strcmp(name, "first_fit") == 0)
+        strategy = first_fit;
+      else if (strcmp(name, "next_fit") == 0)
+        strategy = next_fit;
+      else if (strcmp(name, "tree_best_fit") == 0)
+        strategy = tree_best_fit;
+    }
+    shim_strategy = strategy;
+  }
+  return shim_strategy;
+}
+
+// The default strategy goes through its specialized entry points, the others through the function pointer API
+#define SHIM_ALLOC(call, ...) \
+  (get_shim_strategy() == segregated_fit ? segregated_fit_##call(__VA_ARGS__) : custom_##call(__VA_ARGS__, shim_strategy))
+
+// Holds every allocator lock across fork(), so that the child does not inherit a lock owned by another thread
+void shim_prepare_fork(void)
+{
+  pthread_mutex_lock(&trace_lock);
+  for (int i = 0; i < ARENA_COUNT; i++)
+  {
+    pthread_mutex_lock(&arenas[i].lock);
+  }
+  pthread_mutex_lock(&mmap_lock);
+  pthread_mutex_lock(&profile_lock);
+}
+
+void shim_parent_fork(void)
+{
+  pthread_mutex_unlock(&profile_lock);
+  pthread_mutex_unlock(&mmap_lock);
+  for (int i = ARENA_COUNT - 1; i >= 0; i--)
+  {
+    pthread_mutex_unlock(&arenas[i].lock);
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+void shim_child_fork(void)
+{
+  pthread_mutex_init(&profile_lock, NULL);
+  pthread_mutex_init(&mmap_lock, NULL);
+  for (int i = 0; i < ARENA_COUNT; i++)
+  {
+    pthread_mutex_init(&arenas[i].lock, NULL);
+  }
+  // the trace belongs to the parent, the child drops the records it inherited
+  if (trace_fd >= 0)
+  {
+    close(trace_fd);
+    trace_fd = -1;
+    trace_buffer_used = 0;
+  }
+  pthread_mutex_init(&trace_lock, NULL);
+}
+
+const char *shim_profile_path = NULL; // file the heap profile is written to at exit
+
+void shim_dump_profile(void)
+{
+  const char *format = getenv("CUSTOM_ALLOC_PROFILE_FORMAT");
+  int collapsed = format && strcmp(format, "collapsed") == 0;
+  custom_profile_dump(shim_profile_path, collapsed ? PROFILE_COLLAPSED : PROFILE_PPROF);
+}
+
+__attribute__((constructor)) void shim_init(void)
+{
+  get_shim_strategy();
+  custom_mallopt_from_env();
+  const char *trusted = getenv("CUSTOM_ALLOC_TRUSTED");
+  if (trusted)
+  {
+    custom_set_trusted_free(strcmp(trusted, "0") != 0);
+  }
+  const char *huge = getenv("CUSTOM_ALLOC_HUGE_PAGES");
+  if (huge && strcmp(huge, "0") != 0)
+  {
+    custom_set_huge_pages(1);
+  }
+  shim_profile_path = getenv("CUSTOM_ALLOC_PROFILE");
+  if (shim_profile_path)
+  {
+    const char *interval = getenv("CUSTOM_ALLOC_PROFILE_INTERVAL");
+    custom_profile_start(interval ? strtoul(interval, NULL, 0) : PROFILE_SAMPLE_INTERVAL);
+    atexit(shim_dump_profile);
+  }
+  const char *trace = getenv("CUSTOM_ALLOC_TRACE");
+  if (trace)
+  {
+    custom_trace_start(trace);
+  }
+  pthread_atfork(shim_prepare_fork, shim_parent_fork, shim_child_fork);
+}
+
+SHIM_EXPORT void *malloc(size_t size)
+{
+  // malloc(0) must return a unique pointer that can be passed to free
+  void *ptr = SHIM_ALLOC(malloc, size ? size : 1);
+  if (ptr == NULL)
+  {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+SHIM_EXPORT void free(void *ptr)
+{
+  custom_free(ptr);
+}
+
+// C23 sized free
+SHIM_EXPORT void free_sized(void *ptr, size_t size)
+{
+  // malloc(0) handed out a block of 1 byte
+  custom_free_sized(ptr, size ? size : 1);
+}
+
+SHIM_EXPORT void *calloc(size_t nelem, size_t elsize)
+{
+  size_t size;
+  if (__builtin_mul_overflow(nelem, elsize, &size))
+  {
+    errno = ENOMEM;
+    return NULL;
+  }
+  void *ptr = SHIM_ALLOC(calloc, size ? size : 1, 1);
+  if (ptr == NULL)
+  {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+SHIM_EXPORT void *realloc(void *ptr, size_t size)
+{
+  if (ptr && size == 0)
+  {
+    custom_free(ptr);
+    return NULL;
+  }
+  void *new_ptr = SHIM_ALLOC(realloc, ptr, size ? size : 1);
+  if (new_ptr == NULL)
+  {
+    errno = ENOMEM;
+  }
+  return new_ptr;
+}
+
+// glibc implements reallocarray with its internal realloc, so it has to be replaced as well
+SHIM_EXPORT void *reallocarray(void *ptr, size_t nelem, size_t elsize)
+{
+  size_t size;
+  if (__builtin_mul_overflow(nelem, elsize, &size))
+  {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return realloc(ptr, size);
+}
+
+SHIM_EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  return custom_posix_memalign(memptr, alignment, size ? size : 1, get_shim_strategy());
+}
+
+SHIM_EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+  void *ptr = custom_aligned_alloc(alignment, size ? size : 1, get_shim_strategy());
+  if (ptr == NULL)
+  {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+SHIM_EXPORT void *memalign(size_t alignment, size_t size)
+{
+  return aligned_alloc(alignment, size);
+}
+
+SHIM_EXPORT void *valloc(size_t size)
+{
+  return aligned_alloc(os_page_size(), size);
+}
+
+SHIM_EXPORT void *pvalloc(size_t size)
+{
+  size_t page = os_page_size();
+  return aligned_alloc(page, ALLING(size, page));
+}
+
+SHIM_EXPORT size_t malloc_usable_size(void *ptr)
+{
+  return custom_usable_size(ptr);
+}
+
+// The tunable parameters of glibc share their numbers with enum custom_mallopt_param, the others are rejected
+SHIM_EXPORT int mallopt(int param, int value)
+{
+  return custom_mallopt(param, value);
+}
@@ -0,0 +1,42 @@
+#ifndef DRIVER_COMMON_H
+#define DRIVER_COMMON_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+
+// Helpers shared by the benchmark, replay and scalability drivers. Include after custom_alloc.c.
+
+// Maps the tables, queues and latency arrays of a driver. They must not come from the allocator under test,
+// or its heap and its timings would include the driver's own bookkeeping. Exits if mmap fails
+static void *driver_map(size_t length)
+{
+    void *p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+// Returns a monotonic timestamp in nanoseconds
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Advances the xorshift generator "state", which must not be 0, and returns its new value
+static inline uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+#endif
@@ -17,14 +17,33 @@ void print_memory_pool()
     meta_data current = heap_list_start;
     while (current)
     {
-        printf("Address: %p ,Block size: %zu, Block free: %d, Next: %p, Prev: %p\n",current ,current->size, current->free, current->next, current->prev);
-        current = current->next;
+        printf("Address: %p ,Block size: %zu, Block free: %d, Prev free: %d\n", current, BLOCK_SIZE(current), IS_FREE(current) != 0, (current->size & PREV_FREE) != 0);
+        current = next_block(current);
     };
     sbrk(r);
     printf("\n");
     sbrk(-r);
 }
 
+// Prints the allocator counters, unlike print_memory_pool this does not walk the heap
+void print_alloc_stats()
+{
+    struct custom_alloc_stats stats;
+    custom_alloc_stats(&stats);
+    printf("Heap: %zu bytes, in use: %zu bytes in %zu blocks, free: %zu bytes in %zu blocks, mapped: %zu bytes in %zu blocks\n",
+           stats.heap_bytes, stats.in_use_bytes, stats.allocated_blocks, stats.free_bytes, stats.free_blocks, stats.mapped_bytes, stats.mapped_blocks);
+    printf("Largest free block: %zu, fragmentation: %.3f, sbrk calls: %zu, brk calls: %zu\n",
+           stats.largest_free_block, stats.fragmentation, stats.sbrk_calls, stats.brk_calls);
+    const char *strategies[FIT_COUNT] = {"best fit", "next fit", "first fit", "segregated fit", "tree best fit"};
+    for (int i = 0; i < FIT_COUNT; i++)
+    {
+        if (stats.searches[i])
+        {
+            printf("%s: %zu searches, average search length %.2f\n", strategies[i], stats.searches[i], stats.average_search_length[i]);
+        }
+    }
+}
+
 #define DEBUG_PRINT \
     if (DEBUG)      \
     print_memory_pool()
@@ -49,9 +68,13 @@ size_t get_heap_size()
 
 unsigned long *test_malloc(int max_allocations, meta_data (*find_free_block)(meta_data *prev, size_t size), clock_t seed)
 {
+    // the result has to outlive the call, it is overwritten by the next one
+    static unsigned long result[2];
     if (max_allocations <= 0)
     {
-        return (unsigned long[]){0, 0};
+        result[0] = 0;
+        result[1] = 0;
+        return result;
     }
     void *pointers[max_allocations];
     size_t heap_sizes[max_allocations];
@@ -144,7 +167,9 @@ unsigned long *test_malloc(int max_allocations, meta_data (*find_free_block)(met
     size_t average_heap_size = total_heap_size / max_allocations;
 
     // printf("All memory has been freed.\n");
-    return (unsigned long[]){average_duration, average_heap_size};
+    result[0] = average_duration;
+    result[1] = average_heap_size;
+    return result;
 }
 
 
@@ -213,13 +238,215 @@ void test_first_fit(int size, clock_t seed, int stop_index)
     printf("First Fit: Average allocation duration: %lu, Average heap size: %lu\n", result[0], result[1]);
 }
 
+void test_segregated_fit(int size, clock_t seed, int stop_index)
+{
+    stop_loop_index = stop_index;
+    unsigned long *result = test_malloc(size, &segregated_fit, seed);
+    printf("Segregated Fit: Average allocation duration: %lu, Average heap size: %lu\n", result[0], result[1]);
+}
+
+void test_tree_best_fit(int size, clock_t seed, int stop_index)
+{
+    stop_loop_index = stop_index;
+    unsigned long *result = test_malloc(size, &tree_best_fit, seed);
+    printf("Tree Best Fit: Average allocation duration: %lu, Average heap size: %lu\n", result[0], result[1]);
+}
+
+
+// Runs the same allocation sequence with and without deferred coalescing and reports the
+// throughput gained and the fragmentation cost, the growth of the average heap size
+void test_deferred_coalescing(int size, meta_data (*find_free_block)(meta_data *, size_t), clock_t seed)
+{
+    // warm up, so that neither measured run pays for growing the heap the first time
+    test_malloc(size, find_free_block, seed);
+
+    unsigned long *result = test_malloc(size, find_free_block, seed);
+    unsigned long duration = result[0];
+    unsigned long heap_size = result[1];
+
+    custom_set_deferred_coalescing(1);
+    result = test_malloc(size, find_free_block, seed);
+    unsigned long deferred_duration = result[0];
+    unsigned long deferred_heap_size = result[1];
+    custom_set_deferred_coalescing(0);
+
+    printf("Deferred coalescing: Average allocation duration: %lu -> %lu (%+.1f%% throughput), Average heap size: %lu -> %lu (%+.1f%%)\n",
+           duration, deferred_duration, deferred_duration ? 100.0 * ((double)duration / deferred_duration - 1) : 0.0,
+           heap_size, deferred_heap_size, heap_size ? 100.0 * ((double)deferred_heap_size / heap_size - 1) : 0.0);
+}
+
+// Simulates request handlers that allocate many temporary objects and drop them at the end of the request,
+// once freeing them one by one and once resetting a region, and reports the duration of both
+void test_region(int requests, int objects, meta_data (*find_free_block)(meta_data *, size_t), clock_t seed)
+{
+    void *pointers[objects];
+
+    srand(seed);
+    unsigned long start_time = clock();
+    for (int i = 0; i < requests; i++)
+    {
+        for (int j = 0; j < objects; j++)
+        {
+            pointers[j] = custom_malloc(rand() % 512 + 1, find_free_block);
+        }
+        for (int j = 0; j < objects; j++)
+        {
+            custom_free(pointers[j]);
+        }
+    }
+    unsigned long duration = clock() - start_time;
+
+    srand(seed);
+    start_time = clock();
+    struct custom_arena *arena = custom_arena_create(0, find_free_block);
+    for (int i = 0; i < requests; i++)
+    {
+        for (int j = 0; j < objects; j++)
+        {
+            pointers[j] = custom_arena_alloc(arena, rand() % 512 + 1);
+        }
+        custom_arena_reset(arena);
+    }
+    custom_arena_destroy(arena);
+    unsigned long region_duration = clock() - start_time;
+
+    printf("Region: %d requests of %d objects, malloc/free: %lu, region: %lu\n", requests, objects, duration, region_duration);
+}
+
+// Allocates and frees "objects" nodes of "size" bytes in bulk, once one by one and once with the batch
+// entry points, and reports the duration of both
+void test_batch(int rounds, int objects, size_t size, meta_data (*find_free_block)(meta_data *, size_t))
+{
+    void *pointers[objects];
 
+    unsigned long start_time = clock();
+    for (int i = 0; i < rounds; i++)
+    {
+        for (int j = 0; j < objects; j++)
+        {
+            pointers[j] = custom_malloc(size, find_free_block);
+        }
+        for (int j = 0; j < objects; j++)
+        {
+            custom_free(pointers[j]);
+        }
+    }
+    unsigned long duration = clock() - start_time;
+
+    start_time = clock();
+    for (int i = 0; i < rounds; i++)
+    {
+        custom_malloc_batch(objects, size, pointers, find_free_block);
+        custom_free_batch(objects, pointers);
+    }
+    unsigned long batch_duration = clock() - start_time;
+
+    printf("Batch: %d rounds of %d objects of %zu bytes, one by one: %lu, batch: %lu\n", rounds, objects, size, duration, batch_duration);
+}
+
+// Frees a run of adjacent next fit blocks in one batch, which merges them into the first one, and checks that
+// next fit does not resume from a header inside the merged run afterwards
+void test_batch_next_fit_cursor()
+{
+    void *pointers[10];
+
+    void *pin = custom_malloc(1000, &next_fit);
+    for (int i = 0; i < 10; i++)
+    {
+        pointers[i] = custom_malloc(1000, &next_fit);
+    }
+    custom_free_batch(10, pointers);
+
+    void *aligned = custom_memalign(64, 9500, &next_fit);
+    assert(aligned != NULL && ((uintptr_t)aligned & 63) == 0);
+    memset(aligned, 0xAB, 9500);
+    void *after = custom_malloc(500, &next_fit);
+    assert(after != NULL);
+
+    custom_free(after);
+    custom_free(aligned);
+    custom_free(pin);
+    printf("Batch next fit cursor: ok\n");
+}
+
+// Grows the heap from a fence just below a page boundary many times and checks that calloc clears the words the
+// growth path wrote into the new block above the first fresh page, with free blocks around so that they hold links
+void test_calloc_fresh_growth(meta_data (*find_free_block)(meta_data *, size_t))
+{
+    void *holes[16];
+    void *guards[16];
+    void *fillers[64];
+    size_t trim = trim_threshold;
+    size_t pad = top_pad;
+    custom_mallopt(CUSTOM_M_TRIM_THRESHOLD, 0);
+    custom_mallopt(CUSTOM_M_TOP_PAD, 0);
+
+    for (int i = 0; i < 16; i++)
+    {
+        holes[i] = custom_malloc(1100 + 200 * i, find_free_block);
+        guards[i] = custom_malloc(2000, find_free_block);
+    }
+    for (int i = 0; i < 16; i++)
+    {
+        custom_free(holes[i]);
+    }
+
+    int failures = 0;
+    for (int i = 0; i < 64; i++)
+    {
+        // moves the fence so that the writable area of the next block starts 16 or 32 bytes below a page boundary
+        uintptr_t fence = (uintptr_t)heap_list_fence;
+        uintptr_t target = ALLING(fence + META_DATA_SIZE, PAGE_SIZE) - META_DATA_SIZE - 16 * (1 + (i & 1));
+        size_t filler = target - fence;
+        // larger than the holes, so that it is carved at the fence
+        while (filler < 8192)
+        {
+            filler += PAGE_SIZE;
+        }
+        fillers[i] = custom_malloc(filler - META_DATA_SIZE, find_free_block);
+
+        unsigned char *array = custom_calloc(98758, 1, find_free_block);
+        assert(array != NULL);
+        for (size_t j = 0; j < 98758; j++)
+        {
+            if (array[j] != 0)
+            {
+                failures++;
+                break;
+            }
+        }
+        custom_free(array);
+    }
+
+    for (int i = 0; i < 64; i++)
+    {
+        custom_free(fillers[i]);
+    }
+    for (int i = 0; i < 16; i++)
+    {
+        custom_free(guards[i]);
+    }
+    custom_mallopt(CUSTOM_M_TRIM_THRESHOLD, trim);
+    custom_mallopt(CUSTOM_M_TOP_PAD, pad);
+    printf("Calloc fresh growth: %d of 64 arrays not zeroed\n", failures);
+    assert(failures == 0);
+}
 
 int main(void)
 {
     run_test("best_fit.txt", &best_fit);
+    // the objects the thread cached would count as in use
+    custom_thread_cache_flush();
+    print_alloc_stats();
     //run_test("next_fit.txt", &next_fit);
     //run_test("first_fit.txt", &first_fit);
+    //run_test("segregated_fit.txt", &segregated_fit);
+    //run_test("tree_best_fit.txt", &tree_best_fit);
+    test_deferred_coalescing(MAX_ALLOCATIONS, &segregated_fit, SEED);
+    //test_region(10000, 500, &segregated_fit, SEED);
+    //test_batch(2000, 1000, 600, &segregated_fit);
+    //test_batch_next_fit_cursor();
+    //test_calloc_fresh_growth(&next_fit);
     // test_next_fit();
 
 }
\ No newline at end of file
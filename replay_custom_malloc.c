@@ -0,0 +1,260 @@
+#include "./custom-alloc/custom_alloc.c"
+#include "./driver_common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <malloc.h>
+#include <sys/stat.h>
+
+// Replays a trace recorded with custom_trace_start() against a fit strategy or glibc malloc.
+//
+// Every operation of the trace is run in order and timed with clock_gettime. One CSV line is printed
+// per step, or every "interval" steps: the step, its operation and size, its latency, the time spent
+// in the allocator so far and the heap size after it. A summary goes to stderr at the end.
+//
+// Build: gcc -O2 -o replay_custom_malloc replay_custom_malloc.c -lpthread -lm
+// Usage: replay_custom_malloc trace [best_fit|next_fit|first_fit|segregated_fit|tree_best_fit|glibc] [interval]
+
+#define EMPTY_ID 0 // traced addresses are never 0, failed allocations are not replayed
+
+// Open addressing table from the traced addresses to the objects the replay allocated in their place
+struct object_map
+{
+    uint64_t *ids;
+    void **objects;
+    size_t capacity; // a power of two
+    size_t count;
+};
+
+static inline size_t map_slot(const struct object_map *map, uint64_t id)
+{
+    // the ids are addresses of the traced program, whose low bits are all zero; Fibonacci hashing takes the
+    // slot from the middle of the product, where every bit of the id has had an effect
+    return (size_t)((id * 0x9E3779B97F4A7C15ULL) >> 32) & (map->capacity - 1);
+}
+
+static void map_init(struct object_map *map, size_t capacity)
+{
+    map->capacity = capacity;
+    map->count = 0;
+    map->ids = driver_map(capacity * sizeof(uint64_t));
+    map->objects = driver_map(capacity * sizeof(void *));
+}
+
+static void map_put(struct object_map *map, uint64_t id, void *object);
+
+static void map_grow(struct object_map *map)
+{
+    struct object_map old = *map;
+    map_init(map, old.capacity * 2);
+    for (size_t i = 0; i < old.capacity; i++)
+    {
+        if (old.ids[i] != EMPTY_ID)
+        {
+            map_put(map, old.ids[i], old.objects[i]);
+        }
+    }
+    munmap(old.ids, old.capacity * sizeof(uint64_t));
+    munmap(old.objects, old.capacity * sizeof(void *));
+}
+
+static void map_put(struct object_map *map, uint64_t id, void *object)
+{
+    if (2 * (map->count + 1) > map->capacity)
+    {
+        map_grow(map);
+    }
+    size_t slot = map_slot(map, id);
+    while (map->ids[slot] != EMPTY_ID && map->ids[slot] != id)
+    {
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+    if (map->ids[slot] == EMPTY_ID)
+    {
+        map->count++;
+    }
+    map->ids[slot] = id;
+    map->objects[slot] = object;
+}
+
+// Removes "id" from the map and returns its object, or NULL if the trace never allocated it
+static void *map_take(struct object_map *map, uint64_t id)
+{
+    size_t slot = map_slot(map, id);
+    while (map->ids[slot] != id)
+    {
+        if (map->ids[slot] == EMPTY_ID)
+        {
+            return NULL;
+        }
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+    void *object = map->objects[slot];
+    map->ids[slot] = EMPTY_ID;
+    map->count--;
+    // shifts the following entries back, so that no lookup stops early at the hole
+    size_t hole = slot;
+    for (size_t next = (slot + 1) & (map->capacity - 1); map->ids[next] != EMPTY_ID; next = (next + 1) & (map->capacity - 1))
+    {
+        size_t home = map_slot(map, map->ids[next]);
+        // an entry may move into the hole if its home slot is not between the hole and itself
+        if (((next - home) & (map->capacity - 1)) >= ((next - hole) & (map->capacity - 1)))
+        {
+            map->ids[hole] = map->ids[next];
+            map->objects[hole] = map->objects[next];
+            map->ids[next] = EMPTY_ID;
+            hole = next;
+        }
+    }
+    return object;
+}
+
+// Returns the bytes taken from the system by the allocator under test
+static size_t heap_size(meta_data (*find_free_block)(meta_data *prev, size_t size))
+{
+    if (find_free_block == NULL)
+    {
+        struct mallinfo2 info = mallinfo2();
+        return info.arena + info.hblkhd;
+    }
+    struct custom_alloc_stats stats;
+    custom_alloc_stats(&stats);
+    return stats.heap_bytes + stats.mapped_bytes;
+}
+
+// Runs one operation of the trace and returns 0 if it had to be skipped. "latency" receives the time spent in the
+// allocator call alone, without the lookups and updates of the object map
+static int replay(const struct trace_record *record, struct object_map *map,
+                  meta_data (*find_free_block)(meta_data *prev, size_t size), uint64_t *latency)
+{
+    void *ptr = NULL;
+    uint64_t start;
+    *latency = 0;
+    switch (record->op)
+    {
+    case TRACE_MALLOC:
+        start = now_ns();
+        ptr = find_free_block ? custom_malloc(record->size, find_free_block) : malloc(record->size);
+        *latency = now_ns() - start;
+        break;
+    case TRACE_CALLOC:
+        start = now_ns();
+        ptr = find_free_block ? custom_calloc(record->size, 1, find_free_block) : calloc(record->size, 1);
+        *latency = now_ns() - start;
+        break;
+    case TRACE_MEMALIGN:
+        start = now_ns();
+        ptr = find_free_block ? custom_memalign(record->old_ptr, record->size, find_free_block)
+                              : memalign(record->old_ptr, record->size);
+        *latency = now_ns() - start;
+        break;
+    case TRACE_FREE:
+    {
+        // objects allocated before the trace started are unknown, their free is skipped
+        void *object = map_take(map, record->ptr);
+        if (object == NULL)
+        {
+            return 0;
+        }
+        start = now_ns();
+        find_free_block ? custom_free(object) : free(object);
+        *latency = now_ns() - start;
+        return 1;
+    }
+    case TRACE_REALLOC:
+    {
+        void *object = record->old_ptr ? map_take(map, record->old_ptr) : NULL;
+        start = now_ns();
+        ptr = find_free_block ? custom_realloc(object, record->size, find_free_block) : realloc(object, record->size);
+        *latency = now_ns() - start;
+        if (ptr == NULL && object)
+        {
+            // a failed realloc leaves the object where it was
+            map_put(map, record->old_ptr, object);
+        }
+        break;
+    }
+    default:
+        return 0;
+    }
+    if (record->ptr != EMPTY_ID && ptr)
+    {
+        map_put(map, record->ptr, ptr);
+    }
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s trace [best_fit|next_fit|first_fit|segregated_fit|tree_best_fit|glibc] [interval]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *strategy = argc > 2 ? argv[2] : "segregated_fit";
+    size_t interval = argc > 3 ? strtoul(argv[3], NULL, 10) : 1;
+    if (interval == 0)
+    {
+        interval = 1;
+    }
+
+    meta_data (*find_free_block)(meta_data *prev, size_t size);
+    if (strcmp(strategy, "best_fit") == 0)
+        find_free_block = best_fit;
+    else if (strcmp(strategy, "next_fit") == 0)
+        find_free_block = next_fit;
+    else if (strcmp(strategy, "first_fit") == 0)
+        find_free_block = first_fit;
+    else if (strcmp(strategy, "segregated_fit") == 0)
+        find_free_block = segregated_fit;
+    else if (strcmp(strategy, "tree_best_fit") == 0)
+        find_free_block = tree_best_fit;
+    else if (strcmp(strategy, "glibc") == 0)
+        find_free_block = NULL;
+    else
+    {
+        fprintf(stderr, "unknown strategy %s\n", strategy);
+        return EXIT_FAILURE;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    size_t length = st.st_size;
+    const char *trace = length ? mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (trace == MAP_FAILED || length < sizeof(TRACE_MAGIC) - 1 || memcmp(trace, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1) != 0)
+    {
+        fprintf(stderr, "%s: not a trace\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    const struct trace_record *records = (const struct trace_record *)(trace + sizeof(TRACE_MAGIC) - 1);
+    size_t count = (length - (sizeof(TRACE_MAGIC) - 1)) / sizeof(struct trace_record);
+
+    struct object_map map;
+    map_init(&map, 1 << 16);
+    static const char *op_names[] = {"malloc", "free", "realloc", "calloc", "memalign"};
+    uint64_t total = 0;
+    size_t skipped = 0;
+    printf("step,op,size,latency_ns,total_ns,heap_bytes\n");
+    for (size_t i = 0; i < count; i++)
+    {
+        struct trace_record record;
+        memcpy(&record, &records[i], sizeof(record));
+        uint64_t latency;
+        int replayed = replay(&record, &map, find_free_block, &latency);
+        total += latency;
+        skipped += !replayed;
+        if (i % interval == 0 || i == count - 1)
+        {
+            printf("%zu,%s,%lu,%lu,%lu,%zu\n", i, record.op <= TRACE_MEMALIGN ? op_names[record.op] : "unknown",
+                   (unsigned long)record.size, (unsigned long)latency, (unsigned long)total, heap_size(find_free_block));
+        }
+    }
+    fprintf(stderr, "%s: %zu operations in %.6f s, %zu skipped, %zu objects left, heap %zu bytes\n", strategy, count,
+            total / 1e9, skipped, map.count, heap_size(find_free_block));
+    return EXIT_SUCCESS;
+}
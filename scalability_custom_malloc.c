@@ -0,0 +1,409 @@
+#include "./custom-alloc/custom_alloc.c"
+#include "./driver_common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+// Multi-threaded scalability suite for the allocator and glibc malloc.
+//
+// Every (allocator, workload, threads) triple runs in a fresh child process, for 1, 2, 4, 8 ... threads up to the
+// given maximum. Each thread performs the same number of operations whatever the thread count, so an allocator that
+// scales perfectly keeps the run time flat. The results are written to stdout as CSV, one line per triple: the
+// throughput, the scaling efficiency, i.e. the throughput divided by the thread count times the single thread
+// throughput of the same allocator and workload, and the peak resident set size.
+//
+// larson:       server simulation after Larson and Krishnan, threads replace random objects of their own slots and
+//               hand the slots over to a new thread every round, which frees what the old one allocated
+// xmalloc:      every thread allocates batches of objects that the next thread frees, as in xmalloc-test
+// thread_churn: short lived threads allocate and free a burst of objects and leave a few for the next generation
+//
+// Build: gcc -O2 -o scalability_custom_malloc scalability_custom_malloc.c -lpthread -lm
+// Usage: scalability_custom_malloc [operations per thread] [max threads]
+
+#define DEFAULT_OPERATIONS 200000 // per thread
+#define LARSON_SLOTS 1000         // live objects per larson thread
+#define LARSON_ROUNDS 10          // threads that take over the slots of a larson chain in turn
+#define LARSON_MIN_SIZE 16
+#define LARSON_MAX_SIZE 1024
+#define XMALLOC_BATCH 64          // objects handed over at once
+#define XMALLOC_QUEUE 64          // batches in flight towards a thread, a power of two
+#define XMALLOC_MAX_SIZE 512
+#define CHURN_OBJECTS 1000        // objects a churn thread allocates in its life
+#define CHURN_KEPT 50             // objects it leaves to its successor
+#define CHURN_MAX_SIZE 2048
+#define SEED 42
+
+struct allocator
+{
+    const char *name;
+    meta_data (*find_free_block)(meta_data *prev, size_t size); // NULL for glibc malloc
+};
+
+// Results of a triple, written by the children into shared memory
+struct scale_result
+{
+    size_t operations;
+    double seconds;
+    size_t peak_rss; // in kilobytes
+};
+
+// A queue of batches from one thread to the next, with a single producer and a single consumer
+struct batch_queue
+{
+    void **batches[XMALLOC_QUEUE];
+    size_t head; // next batch to free, only advanced by the consumer
+    size_t tail; // next free entry, only advanced by the producer
+};
+
+struct worker
+{
+    const struct allocator *allocator;
+    size_t operations;  // operations to perform
+    size_t done;        // operations performed
+    uint64_t random_state;
+    void **slots;       // larson slots, churn objects left by the previous generation
+    size_t *pending;    // xmalloc: threads still producing
+    struct batch_queue *in;  // xmalloc: batches to free
+    struct batch_queue *out; // xmalloc: batches for the next thread
+    void **batches;     // xmalloc: one batch per entry of "out", reused once its consumer moved past it
+    int producing;      // xmalloc: whether this thread still allocates
+};
+
+static void *scale_malloc(struct worker *w, size_t size)
+{
+    void *ptr = w->allocator->find_free_block ? custom_malloc(size, w->allocator->find_free_block) : malloc(size);
+    if (ptr == NULL)
+    {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    // the first byte is written, as any real program would
+    *(volatile char *)ptr = 1;
+    w->done++;
+    return ptr;
+}
+
+static void scale_free(struct worker *w, void *ptr)
+{
+    w->allocator->find_free_block ? custom_free(ptr) : free(ptr);
+    w->done++;
+}
+
+static void start_thread(pthread_t *thread, void *(*run)(void *), struct worker *w)
+{
+    if (pthread_create(thread, NULL, run, w) != 0)
+    {
+        perror("pthread_create failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// One round of a larson chain: replaces random objects of the slots, which the previous thread of the chain filled
+static void *larson_round(void *arg)
+{
+    struct worker *w = arg;
+    size_t end = w->done + w->operations / LARSON_ROUNDS;
+    while (w->done < end)
+    {
+        size_t slot = next_random(&w->random_state) % LARSON_SLOTS;
+        if (w->slots[slot])
+        {
+            scale_free(w, w->slots[slot]);
+        }
+        w->slots[slot] = scale_malloc(w, LARSON_MIN_SIZE + next_random(&w->random_state) % (LARSON_MAX_SIZE - LARSON_MIN_SIZE + 1));
+    }
+    return NULL;
+}
+
+// Runs the rounds of a chain one thread after the other
+static void *larson_chain(void *arg)
+{
+    struct worker *w = arg;
+    for (int round = 0; round < LARSON_ROUNDS; round++)
+    {
+        pthread_t thread;
+        start_thread(&thread, larson_round, w);
+        pthread_join(thread, NULL);
+    }
+    for (size_t slot = 0; slot < LARSON_SLOTS; slot++)
+    {
+        if (w->slots[slot])
+        {
+            scale_free(w, w->slots[slot]);
+        }
+    }
+    return NULL;
+}
+
+static void larson_workload(struct worker *workers, size_t threads)
+{
+    pthread_t *chains = driver_map(threads * sizeof(pthread_t));
+    for (size_t t = 0; t < threads; t++)
+    {
+        workers[t].slots = driver_map(LARSON_SLOTS * sizeof(void *));
+        start_thread(&chains[t], larson_chain, &workers[t]);
+    }
+    for (size_t t = 0; t < threads; t++)
+    {
+        pthread_join(chains[t], NULL);
+        munmap(workers[t].slots, LARSON_SLOTS * sizeof(void *));
+    }
+    munmap(chains, threads * sizeof(pthread_t));
+}
+
+// Frees the batches queued for the thread, returns 0 if there were none
+static int xmalloc_consume(struct worker *w)
+{
+    struct batch_queue *queue = w->in;
+    size_t head = queue->head;
+    if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+    while (head != __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE))
+    {
+        void **batch = queue->batches[head % XMALLOC_QUEUE];
+        for (size_t i = 0; i < XMALLOC_BATCH; i++)
+        {
+            scale_free(w, batch[i]);
+        }
+        head++;
+        __atomic_store_n(&queue->head, head, __ATOMIC_RELEASE);
+    }
+    return 1;
+}
+
+// Allocates batches for the next thread and frees those of the previous one, until both are done
+static void *xmalloc_thread(void *arg)
+{
+    struct worker *w = arg;
+    // half of the operations are allocations, the frees of the batches are counted by their consumer
+    size_t batches_left = MAX(w->operations / 2 / XMALLOC_BATCH, 1);
+    while (w->producing || __atomic_load_n(w->pending, __ATOMIC_ACQUIRE) > 0 ||
+           w->in->head != __atomic_load_n(&w->in->tail, __ATOMIC_ACQUIRE))
+    {
+        int progress = xmalloc_consume(w);
+        struct batch_queue *queue = w->out;
+        if (w->producing && queue->tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) < XMALLOC_QUEUE)
+        {
+            void **batch = w->batches + (queue->tail % XMALLOC_QUEUE) * XMALLOC_BATCH;
+            for (size_t i = 0; i < XMALLOC_BATCH; i++)
+            {
+                batch[i] = scale_malloc(w, next_random(&w->random_state) % XMALLOC_MAX_SIZE + 1);
+            }
+            queue->batches[queue->tail % XMALLOC_QUEUE] = batch;
+            __atomic_store_n(&queue->tail, queue->tail + 1, __ATOMIC_RELEASE);
+            progress = 1;
+            if (--batches_left == 0)
+            {
+                w->producing = 0;
+                __atomic_fetch_sub(w->pending, 1, __ATOMIC_RELEASE);
+            }
+        }
+        if (!progress)
+        {
+            // the threads may outnumber the CPUs
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void xmalloc_workload(struct worker *workers, size_t threads)
+{
+    struct batch_queue *queues = driver_map(threads * sizeof(struct batch_queue));
+    pthread_t *pool = driver_map(threads * sizeof(pthread_t));
+    size_t pending = threads;
+    for (size_t t = 0; t < threads; t++)
+    {
+        workers[t].in = &queues[t];
+        workers[t].out = &queues[(t + 1) % threads];
+        workers[t].pending = &pending;
+        workers[t].producing = 1;
+        // the batches outlive their producer until the consumer is done with them
+        workers[t].batches = driver_map(XMALLOC_QUEUE * XMALLOC_BATCH * sizeof(void *));
+    }
+    for (size_t t = 0; t < threads; t++)
+    {
+        start_thread(&pool[t], xmalloc_thread, &workers[t]);
+    }
+    for (size_t t = 0; t < threads; t++)
+    {
+        pthread_join(pool[t], NULL);
+    }
+    for (size_t t = 0; t < threads; t++)
+    {
+        munmap(workers[t].batches, XMALLOC_QUEUE * XMALLOC_BATCH * sizeof(void *));
+    }
+    munmap(pool, threads * sizeof(pthread_t));
+    munmap(queues, threads * sizeof(struct batch_queue));
+}
+
+// Life of a churn thread: frees what its predecessor left, allocates a burst, frees most of it
+static void *churn_thread(void *arg)
+{
+    struct worker *w = arg;
+    for (size_t i = 0; i < CHURN_KEPT; i++)
+    {
+        if (w->slots[i])
+        {
+            scale_free(w, w->slots[i]);
+            w->slots[i] = NULL;
+        }
+    }
+    void *objects[CHURN_OBJECTS];
+    for (size_t i = 0; i < CHURN_OBJECTS; i++)
+    {
+        objects[i] = scale_malloc(w, next_random(&w->random_state) % CHURN_MAX_SIZE + 1);
+    }
+    for (size_t i = 0; i < CHURN_OBJECTS; i++)
+    {
+        if (i < CHURN_KEPT)
+        {
+            w->slots[i] = objects[i];
+        }
+        else
+        {
+            scale_free(w, objects[i]);
+        }
+    }
+    return NULL;
+}
+
+static void churn_workload(struct worker *workers, size_t threads)
+{
+    pthread_t *generation = driver_map(threads * sizeof(pthread_t));
+    for (size_t t = 0; t < threads; t++)
+    {
+        workers[t].slots = driver_map(CHURN_KEPT * sizeof(void *));
+    }
+    // a thread performs about 2 * CHURN_OBJECTS operations
+    size_t generations = MAX(workers[0].operations / (2 * CHURN_OBJECTS), 1);
+    for (size_t g = 0; g < generations; g++)
+    {
+        for (size_t t = 0; t < threads; t++)
+        {
+            start_thread(&generation[t], churn_thread, &workers[t]);
+        }
+        for (size_t t = 0; t < threads; t++)
+        {
+            pthread_join(generation[t], NULL);
+        }
+    }
+    for (size_t t = 0; t < threads; t++)
+    {
+        for (size_t i = 0; i < CHURN_KEPT; i++)
+        {
+            if (workers[t].slots[i])
+            {
+                scale_free(&workers[t], workers[t].slots[i]);
+            }
+        }
+        munmap(workers[t].slots, CHURN_KEPT * sizeof(void *));
+    }
+    munmap(generation, threads * sizeof(pthread_t));
+}
+
+struct workload
+{
+    const char *name;
+    void (*run)(struct worker *workers, size_t threads);
+};
+
+// Runs a workload in a child process, so that it starts from an empty heap and a small resident set
+static void run_isolated(const struct allocator *allocator, const struct workload *workload, size_t operations,
+                         size_t threads, struct scale_result *result)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork failed");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        struct worker *workers = driver_map(threads * sizeof(struct worker));
+        for (size_t t = 0; t < threads; t++)
+        {
+            workers[t].allocator = allocator;
+            workers[t].operations = operations;
+            workers[t].random_state = SEED + t;
+        }
+        uint64_t start = now_ns();
+        workload->run(workers, threads);
+        uint64_t end = now_ns();
+        result->seconds = (end - start) / 1e9;
+        for (size_t t = 0; t < threads; t++)
+        {
+            result->operations += workers[t].done;
+        }
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        result->peak_rss = usage.ru_maxrss;
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "%s %s %zu threads: benchmark process failed\n", allocator->name, workload->name, threads);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t operations = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_OPERATIONS;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_threads = argc > 2 ? strtoul(argv[2], NULL, 10) : (size_t)MAX(cpus, 8);
+    if (operations < 2 * CHURN_OBJECTS || max_threads == 0)
+    {
+        fprintf(stderr, "usage: %s [operations per thread, at least %d] [max threads]\n", argv[0], 2 * CHURN_OBJECTS);
+        return EXIT_FAILURE;
+    }
+
+    const struct allocator allocators[] = {
+        {"segregated_fit", &segregated_fit},
+        {"tree_best_fit", &tree_best_fit},
+        {"glibc", NULL},
+    };
+    const struct workload workloads[] = {
+        {"larson", &larson_workload},
+        {"xmalloc", &xmalloc_workload},
+        {"thread_churn", &churn_workload},
+    };
+
+    // the children report through memory shared with this process
+    struct scale_result *result = mmap(NULL, sizeof(*result), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (result == MAP_FAILED)
+    {
+        perror("mmap failed");
+        return EXIT_FAILURE;
+    }
+
+    printf("allocator,workload,threads,operations,seconds,ops_per_second,scaling_efficiency,peak_rss_kb\n");
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+    {
+        for (size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++)
+        {
+            double single = 0; // throughput of one thread
+            for (size_t threads = 1; threads <= max_threads; threads *= 2)
+            {
+                memset(result, 0, sizeof(*result));
+                run_isolated(&allocators[a], &workloads[w], operations, threads, result);
+                double throughput = result->operations / result->seconds;
+                if (threads == 1)
+                {
+                    single = throughput;
+                }
+                printf("%s,%s,%zu,%zu,%.6f,%.0f,%.3f,%zu\n", allocators[a].name, workloads[w].name, threads,
+                       result->operations, result->seconds, throughput, throughput / (threads * single),
+                       result->peak_rss);
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}